@@ -12,174 +12,2777 @@
 #include "parse.h"
 #include "errors.h"
 #include "validate.h"
+#include "emit.h"
+#include "smtable.h"
 
 static FILE *fp;
+static emit_options_t *opts;
 
 static char *first_part[] = {
     "/*******************************************************************************",
     "*  Generated code below this point",
     "******************************************************************************/",
     "",
+    "#include <stdint.h>",
+    "",
     "typedef struct {",
     "    int state;",
-    "    int (*func)(void);",
+    "    int (*func)($P);",
     "} state_t;",
     "",
-    "//#define DEBUGGING",
+    "//#define DEBUGGING",
+    "",
+    "#ifdef DEBUGGING",
+    "#  define PRINT(fmt, ...) fprintf(stderr, fmt, ## __VA_ARGS__)",
+    "#else",
+    "#  define PRINT(fmt, ...)",
+    "#endif",
+    "",
+    "$C",
+    "",
+    "// Function protos",
+    NULL,
+};
+
+// do not change this unless you know what you are doing.
+static char *runner[] = {
+    "\n",
+    "    int state = START;\n",
+    "    PRINT(\"\\nSM %s() ENTER\\n\", __func__);\n",
+    "    do{\n",
+    "        int trans = %s;\n",
+    "        PRINT(\"state = %d: trans = %d\" PRINT_CHAR_FMT \" => func: %s state: %d\\n\",\n",
+    "                state, trans PRINT_CHAR_ARGS,\n",
+    "                sm_action_names[$M_actions[state][trans]],\n",
+    "                states[state][trans].state);\n",
+    "        if(states[state][trans].func != NULL)\n",
+    "            (*states[state][trans].func)($A);\n",
+    "        state = states[state][trans].state;\n",
+    "    }while(state != END && state != ERROR);\n",
+    "    PRINT(\"SM %s() RETURNING\\n\", __func__);\n",
+    "\n",
+    NULL
+};
+
+// same as above, but for the split next state and action tables.
+static char *table_runner[] = {
+    "\n",
+    "    int state = START;\n",
+    "    PRINT(\"\\nSM %s() ENTER\\n\", __func__);\n",
+    "    do{\n",
+    "        int trans = %s;\n",
+    "        int col = trans_class[trans];\n",
+    "        int func = action[state][col];\n",
+    "        PRINT(\"state = %d: trans = %d\" PRINT_CHAR_FMT \" => func: %s state: %d\\n\",\n",
+    "                state, trans PRINT_CHAR_ARGS,\n",
+    "                sm_action_names[func], next[state][col]);\n",
+    "        if(func != 0)\n",
+    "            (*actions[func])($A);\n",
+    "        state = next[state][col];\n",
+    "    }while(state != END && state != ERROR);\n",
+    "    PRINT(\"SM %s() RETURNING\\n\", __func__);\n",
+    "\n",
+    NULL
+};
+
+// same as above, but for the row displacement (comb) tables.
+static char *comb_runner[] = {
+    "\n",
+    "    int state = START;\n",
+    "    PRINT(\"\\nSM %s() ENTER\\n\", __func__);\n",
+    "    do{\n",
+    "        int trans = %s;\n",
+    "        int slot = base[state] + trans_class[trans];\n",
+    "        int func = (check[slot] == state)? comb_action[slot]: default_action[state];\n",
+    "        int next = (check[slot] == state)? comb_next[slot]: default_next[state];\n",
+    "        PRINT(\"state = %d: trans = %d\" PRINT_CHAR_FMT \" => func: %s state: %d\\n\",\n",
+    "                state, trans PRINT_CHAR_ARGS,\n",
+    "                sm_action_names[func], next);\n",
+    "        if(func != 0)\n",
+    "            (*actions[func])($A);\n",
+    "        state = next;\n",
+    "    }while(state != END && state != ERROR);\n",
+    "    PRINT(\"SM %s() RETURNING\\n\", __func__);\n",
+    "\n",
+    NULL
+};
+
+// the parameter list and the arguments of every generated function.
+static char ctx_param[300] = "void";
+static char *ctx_arg = "";
+
+// PRINT shows the global character, which a machine with a context does not have.
+static char *print_char =
+    "#define PRINT_CHAR_FMT \": char = \'%c\' (0x%02X)\"\n"
+    "#define PRINT_CHAR_ARGS , (character == 0x0a)? \' \': character, character";
+
+// the machine that a runner is being emitted for.
+static char *runner_name = "";
+
+// every machine, for the ones that share a byte table.
+static machine_t *machine_list = NULL;
+
+/*
+ *  Return the machine whose byte table is used by this one.  Machines that
+ *  have the same table share the table of the first one.
+ */
+static machine_t *chars_owner(machine_t *mac) {
+
+    machine_t *owner;
+
+    for(owner = machine_list; owner != mac; owner = owner->next)
+        if(NULL != owner->chars && !memcmp(owner->chars, mac->chars, 256))
+            break;
+    return owner;
+}
+
+/*
+ *  Return the expression that reads the next transition of the machine.  A
+ *  machine with character sets reads a byte and looks it up in its table.
+ */
+static char *read_input(machine_t *mac) {
+
+    static char buf[600];
+
+    if(NULL != mac->chars)
+        snprintf(buf, sizeof(buf), "%s_chars[%s(%s)]", chars_owner(mac)->name, mac->input, ctx_arg);
+    else
+        snprintf(buf, sizeof(buf), "%s(%s)", mac->input, ctx_arg);
+    return buf;
+}
+
+/*
+ *  Copy a line of a template to the buffer, replacing $P with the parameter
+ *  list, $A with the arguments, $M with the name of the machine and $C with
+ *  the definitions of the byte that PRINT shows.
+ */
+static char *expand(char *buf, size_t size, char *text) {
+
+    size_t len = 0;
+    char *str;
+
+    for(; *text != 0 && len < size - 1; text++) {
+        if(text[0] == '$' && (text[1] == 'P' || text[1] == 'A' || text[1] == 'M' || text[1] == 'C')) {
+            str = (text[1] == 'P')? ctx_param: (text[1] == 'A')? ctx_arg:
+                    (text[1] == 'C')? print_char: runner_name;
+            for(; *str != 0 && len < size - 1; str++)
+                buf[len++] = *str;
+            text++;
+        }
+        else
+            buf[len++] = *text;
+    }
+    buf[len] = 0;
+    return buf;
+}
+
+/*
+ *  Emit the hooks that see every transition that the machine takes, where
+ *  state is the expression for the state that it is in.
+ */
+static void emit_hooks(char *indent, machine_t *mac, char *state) {
+
+    if(opts->instrument)
+        fprintf(fp, "%sCOUNT(%s, %s, trans);\n", indent, mac->name, state);
+    if(NULL != opts->trace)
+        fprintf(fp, "%sRECORD(%s, %s, trans);\n", indent, mac->name, state);
+}
+
+static void emit_runner(char *text[], machine_t *mac) {
+
+    char buf[512];
+    int i;
+
+    runner_name = mac->name;
+    for(i = 0; i < 4; i++)
+        fprintf(fp, "%s", expand(buf, sizeof(buf), text[i]));
+    fprintf(fp, expand(buf, sizeof(buf), text[i]), read_input(mac));
+    emit_hooks("        ", mac, "state");
+    for(i++; text[i] != NULL; i++)
+        fprintf(fp, "%s", expand(buf, sizeof(buf), text[i]));
+
+}
+
+// the switch backend reads the input and then switches on the state.
+static char *switch_runner[] = {
+    "",
+    "    int state = START;\n",
+    "    PRINT(\"\\nSM %s() ENTER\\n\", __func__);\n",
+    "    do{\n",
+    "        int trans = %s;\n",
+    "        switch(state) {\n",
+    NULL
+};
+
+static char *switch_runner_end[] = {
+    "        }",
+    "    }while(state != END && state != ERROR);",
+    "    PRINT(\"SM %s() RETURNING\\n\", __func__);",
+    "",
+    NULL
+};
+
+// the backends that do not have a table name the function and state instead.
+static char *trace_part[] = {
+    "#define PRINT_TRANS(from, func, next) \\",
+    "    PRINT(\"state = %d: trans = %d\" PRINT_CHAR_FMT \" => func: %s state: %d\\n\", \\",
+    "            from, trans PRINT_CHAR_ARGS, func, next)",
+    "",
+    NULL
+};
+
+// branch hints for the machines that were laid out by a profile
+static char *profile_part[] = {
+    "#if defined(__GNUC__)",
+    "#  define SM_EXPECT(value, expected) __builtin_expect((value), (expected))",
+    "#else",
+    "#  define SM_EXPECT(value, expected) (value)",
+    "#endif",
+    "#if defined(__GNUC__) && !defined(__clang__)",
+    "#  define SM_COLD __attribute__((cold))",
+    "#else",
+    "#  define SM_COLD",
+    "#endif",
+    "",
+    NULL
+};
+
+// the record that the tracer writes and that the decoder reads.
+static char *trace_record_part[] = {
+    "typedef struct {",
+    "    uint64_t stamp;     // SM_TRACE_STAMP() when the transition was taken",
+    "    uint16_t machine;",
+    "    uint16_t state;",
+    "    uint16_t trans;",
+    "    uint16_t unused;",
+    "} sm_trace_t;",
+    "",
+    NULL
+};
+
+// every thread writes the transitions it takes to its own ring.
+static char *trace_ring_part[] = {
+    "// the number of records kept, which must be a power of two",
+    "#ifndef SM_TRACE_SIZE",
+    "#  define SM_TRACE_SIZE 4096",
+    "#endif",
+    "// define this as a clock or a cycle counter to stamp the records",
+    "#ifndef SM_TRACE_STAMP",
+    "#  define SM_TRACE_STAMP() 0",
+    "#endif",
+    "#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L",
+    "#  define SM_THREAD _Thread_local",
+    "#elif defined(__GNUC__)",
+    "#  define SM_THREAD __thread",
+    "#else",
+    "#  define SM_THREAD",
+    "#endif",
+    "",
+    "static SM_THREAD struct {",
+    "    uint64_t head;",
+    "    sm_trace_t records[SM_TRACE_SIZE];",
+    "} sm_ring;",
+    "",
+    "static inline void sm_record(int machine, int state, int trans) {",
+    "",
+    "    sm_trace_t *rec = &sm_ring.records[sm_ring.head++ & (SM_TRACE_SIZE - 1)];",
+    "",
+    "    rec->stamp = SM_TRACE_STAMP();",
+    "    rec->machine = (uint16_t)machine;",
+    "    rec->state = (uint16_t)state;",
+    "    rec->trans = (uint16_t)trans;",
+    "    rec->unused = 0;",
+    "}",
+    "",
+    "// write the records of this thread to out, oldest first, for the decoder",
+    "static size_t sm_trace_dump(FILE *out) {",
+    "",
+    "    uint64_t i = (sm_ring.head > SM_TRACE_SIZE)? sm_ring.head - SM_TRACE_SIZE: 0;",
+    "    size_t count = 0;",
+    "",
+    "    for(; i < sm_ring.head; i++, count++)",
+    "        if(1 != fwrite(&sm_ring.records[i & (SM_TRACE_SIZE - 1)], sizeof(sm_trace_t), 1, out))",
+    "            break;",
+    "    return count;",
+    "}",
+    "",
+    "#define RECORD(name, state, trans) sm_record(SM_##name, state, trans)",
+    NULL
+};
+
+// the decoder reads the records that sm_trace_dump() wrote.
+static char *decoder_part[] = {
+    "int main(int argc, char **argv) {",
+    "",
+    "    FILE *in = (argc > 1)? fopen(argv[1], \"rb\"): stdin;",
+    "    const sm_trace_tables_t *m;",
+    "    unsigned long count = 0;",
+    "    sm_trace_t rec;",
+    "",
+    "    if(NULL == in) {",
+    "        perror(argv[1]);",
+    "        return 1;",
+    "    }",
+    "",
+    "    printf(\"# record stamp machine state transition => action next\\n\");",
+    "    while(1 == fread(&rec, sizeof(rec), 1, in)) {",
+    "        if(rec.machine >= SM_TRACE_MACHINES",
+    "                || rec.state >= (m = &sm_trace_tables[rec.machine])->num_states",
+    "                || rec.trans >= m->num_trans) {",
+    "            fprintf(stderr, \"DECODE ERROR: record %lu is not from this definition\\n\", count);",
+    "            return 1;",
+    "        }",
+    "        printf(\"%lu %\" PRIu64 \" %s %s %s => %s %s\\n\", count++, rec.stamp, m->name,",
+    "                m->states[rec.state], m->trans[rec.trans],",
+    "                m->action[rec.state * m->num_trans + rec.trans],",
+    "                m->next[rec.state * m->num_trans + rec.trans]);",
+    "    }",
+    "    return 0;",
+    "}",
+    NULL
+};
+
+// what there is to know about a machine.
+static char *reflection_part[] = {
+    "typedef struct {",
+    "    const char *name;",
+    "    int num_states;                 // END and ERROR are numbered after these",
+    "    int num_trans;",
+    "    const char *const *state_names; // [num_states + 2]",
+    "    const char *const *trans_names; // [num_trans]",
+    "    const uint16_t *actions;        // [state * num_trans + trans]",
+    "} sm_machine_info_t;",
+    "",
+    NULL
+};
+
+// look the names up by number.
+static char *reflection_api_part[] = {
+    "#define SM_NUM_MACHINES (int)(sizeof(sm_machines) / sizeof(sm_machines[0]))",
+    "#define SM_NUM_ACTIONS (int)(sizeof(sm_action_names) / sizeof(sm_action_names[0]))",
+    "",
+    "// return the machine, or NULL if there is no such machine",
+    "static inline const sm_machine_info_t *sm_machine_info(int machine) {",
+    "    return (machine >= 0 && machine < SM_NUM_MACHINES)? &sm_machines[machine]: NULL;",
+    "}",
+    "",
+    "static inline const char *sm_machine_name(int machine) {",
+    "    return (machine >= 0 && machine < SM_NUM_MACHINES)? sm_machines[machine].name: \"UNKNOWN\";",
+    "}",
+    "",
+    "static inline const char *sm_state_name(int machine, int state) {",
+    "    const sm_machine_info_t *m = sm_machine_info(machine);",
+    "    return (m && state >= 0 && state < m->num_states + 2)? m->state_names[state]: \"UNKNOWN\";",
+    "}",
+    "",
+    "static inline const char *sm_trans_name(int machine, int trans) {",
+    "    const sm_machine_info_t *m = sm_machine_info(machine);",
+    "    return (m && trans >= 0 && trans < m->num_trans)? m->trans_names[trans]: \"UNKNOWN\";",
+    "}",
+    "",
+    "static inline const char *sm_action_name(int action) {",
+    "    return (action >= 0 && action < SM_NUM_ACTIONS)? sm_action_names[action]: \"UNKNOWN\";",
+    "}",
+    "",
+    "// return the action that the state runs for the transition, or -1",
+    "static inline int sm_trans_action(int machine, int state, int trans) {",
+    "    const sm_machine_info_t *m = sm_machine_info(machine);",
+    "    return (m && state >= 0 && state < m->num_states && trans >= 0 && trans < m->num_trans)?",
+    "            m->actions[state * m->num_trans + trans]: -1;",
+    "}",
+    "",
+    NULL
+};
+
+// state functions return the next state function or the final state.
+static char *tail_part[] = {
+    "typedef struct tail_t tail_t;",
+    "struct tail_t {",
+    "    tail_t (*next)($P);",
+    "    int state;",
+    "};",
+    "",
+    "// without musttail the state functions return to a trampoline instead",
+    "#if defined(__has_attribute)",
+    "#  if __has_attribute(musttail)",
+    "#    define TAIL_CALL(func) __attribute__((musttail)) return func($A)",
+    "#  endif",
+    "#endif",
+    "#ifndef TAIL_CALL",
+    "#  define TAIL_CALL(func) return (tail_t){func, 0}",
+    "#endif",
+    "",
+    NULL
+};
+
+static char *last_part[] = {
+    "",
+    "// End of generated code",
+    NULL
+};
+
+static inline void emit_section(char *text[]) {
+
+    char buf[512];
+    int i;
+
+    for(i = 0; text[i] != NULL; i++)
+        fprintf(fp, "%s\n", expand(buf, sizeof(buf), text[i]));
+}
+
+// all of the functions that are called by transitions, in table order.
+static char **action_list = NULL;
+static int num_actions = 0;
+
+// inline blocks that turned out to be empty.
+static string_list_t *nop_list = NULL;
+
+// the functions that were made from inline blocks.
+static string_list_t *inline_list = NULL;
+
+/*
+ *  Return non-zero if the action does nothing, so the call can be left out.
+ *  That is "nop", an empty inline block or any of the actions that the
+ *  machine lists in its no_op directive.
+ */
+static int is_nop(machine_t *mac, char *name) {
+
+    string_list_t *lst;
+
+    if(!strcmp(name, "nop"))
+        return 1;
+
+    for(lst = nop_list; lst != NULL; lst = lst->next)
+        if(!strcmp(lst->strg, name))
+            return 1;
+
+    for(lst = mac->no_ops; lst != NULL; lst = lst->next)
+        if(!strcmp(lst->strg, name))
+            return 1;
+
+    return 0;
+}
+
+/*
+ *  Return the index of the action in the action list, adding it if it is not
+ *  already there.
+ */
+static int action_index(char *name) {
+
+    int i;
+
+    for(i = 0; i < num_actions; i++) {
+        if(!strcmp(action_list[i], name))
+            return i;
+    }
+
+    if(NULL == (action_list = realloc(action_list, (num_actions + 1) * sizeof(char*))))
+        SERROR(FATAL_ERROR, "Cannot allocate the action list");
+    action_list[num_actions] = name;
+    return num_actions++;
+}
+
+/*
+ *  Return the index of the action of the transition.  Index 0 is kept for the
+ *  actions that do nothing and the runners do not call it.
+ */
+static int action_of(machine_t *mac, transition_t *tran) {
+
+    return is_nop(mac, tran->func)? 0: action_index(tran->func);
+}
+
+static void collect_actions(definition_t *def) {
+
+    machine_t *mac;
+    state_def_t *sd;
+    transition_t *trans;
+
+    action_index("NULL");
+    for(mac = def->machine_list; mac != NULL; mac = mac->next)
+        for(sd = mac->list; sd != NULL; sd = sd->next)
+            for(trans = sd->list; trans != NULL; trans = trans->next)
+                action_of(mac, trans);
+}
+
+/*
+ *  Return non-zero if no transition before this one has the same action.
+ */
+static int first_use(machine_t *mac, transition_t *tran) {
+
+    state_def_t *sd;
+    transition_t *trans;
+
+    for(sd = mac->list; sd != NULL; sd = sd->next)
+        for(trans = sd->list; trans != NULL; trans = trans->next) {
+            if(trans == tran)
+                return 1;
+            if(!strcmp(trans->func, tran->func))
+                return 0;
+        }
+    return 1;
+}
+
+/*
+ *  The actions that do nothing are not called, so name every one of them that
+ *  the machine uses once, or the compiler warns that they are not used.
+ */
+static void emit_nop_refs(machine_t *mac) {
+
+    state_def_t *sd;
+    transition_t *trans;
+    int found = 0;
+
+    for(sd = mac->list; sd != NULL; sd = sd->next)
+        for(trans = sd->list; trans != NULL; trans = trans->next)
+            if(is_nop(mac, trans->func) && first_use(mac, trans)) {
+                fprintf(fp, "    (void)%s;\n", trans->func);
+                found = 1;
+            }
+    if(found)
+        fprintf(fp, "\n");
+}
+
+static void emit_trans(machine_t *mac, state_def_t *state, char *name) {
+
+    transition_t *tran = select_trans(state, name);
+
+    fprintf(fp, "{%s, %s}", tran->state, is_nop(mac, tran->func)? "NULL": tran->func);
+}
+
+/*
+ *  The stack backend builds the table as a local inside of the machine
+ *  function every time that it is called.
+ */
+static void emit_states(machine_t *mac) {
+
+    string_list_t *mlst;
+    string_list_t *tlst;
+
+    fprintf(fp, "    state_t states[%d][%d] = {\n", mac->num_states, mac->num_trans);
+    for(mlst = mac->states; mlst != NULL; mlst = mlst->next) {
+        state_def_t *state = select_state(mac, mlst->strg);
+        //emit_line(mac, lst->strg);
+        fprintf(fp, "        {");
+        for(tlst = mac->trans; tlst != NULL; tlst = tlst->next) {
+            emit_trans(mac, state, tlst->strg);
+            if(tlst->next != NULL)
+                fprintf(fp, ", ");
+        }
+        fprintf(fp, "}");
+        if(mlst->next == NULL)
+            fprintf(fp, "\n");
+        else
+            fprintf(fp, ",\n");
+
+    }
+    fprintf(fp, "    };\n");
+}
+
+/*
+ *  Return the smallest unsigned type that can hold count different values.
+ */
+static char *index_type(int count) {
+
+    if(count <= 0x100)
+        return "uint8_t";
+    else if(count <= 0x10000)
+        return "uint16_t";
+    else
+        return "uint32_t";
+}
+
+static int type_size(int count) {
+
+    if(count <= 0x100)
+        return 1;
+    else if(count <= 0x10000)
+        return 2;
+    else
+        return 4;
+}
+
+static void emit_action_table(void) {
+
+    int i;
+
+    fprintf(fp, "static int (*const actions[%d])(%s) = {\n", num_actions, ctx_param);
+    for(i = 0; i < num_actions; i++)
+        fprintf(fp, "    %s,%*s// %d\n", action_list[i],
+                (int)(24 - strlen(action_list[i])), "", i);
+    fprintf(fp, "};\n\n");
+}
+
+/*
+ *  Return the number of the state in the machine.  END and ERROR come after
+ *  all of the states that are defined.
+ */
+static int state_index(machine_t *mac, char *name) {
+
+    string_list_t *lst;
+    int i;
+
+    for(lst = mac->states, i = 0; lst != NULL; lst = lst->next, i++) {
+        if(!strcmp(lst->strg, name))
+            return i;
+    }
+
+    if(!strcmp(name, "END"))
+        return mac->num_states;
+    else if(!strcmp(name, "ERROR"))
+        return mac->num_states + 1;
+
+    PERROR(name, "Used as a state but is not defined in the state list");
+    return -1;
+}
+
+/*
+ *  Return the transition for every column of the state, in table order.
+ */
+static transition_t **select_row(machine_t *mac, state_def_t *state) {
+
+    transition_t **row;
+    string_list_t *tlst;
+    int i;
+
+    if(NULL == (row = calloc(mac->num_trans, sizeof(transition_t*))))
+        SERROR(FATAL_ERROR, "Cannot allocate the transition row");
+
+    for(tlst = mac->trans, i = 0; tlst != NULL; tlst = tlst->next, i++)
+        row[i] = select_trans(state, tlst->strg);
+
+    return row;
+}
+
+static inline int same_trans(transition_t *a, transition_t *b) {
+    return (!strcmp(a->state, b->state) && !strcmp(a->func, b->func));
+}
+
+/*
+ *  Return the column of the row whose next state and action are shared by the
+ *  most columns.
+ */
+static int most_common(transition_t **row, int width) {
+
+    int i, j, count, best = 0, best_count = 0;
+
+    for(i = 0; i < width; i++) {
+        for(j = 0, count = 0; j < width; j++)
+            count += same_trans(row[i], row[j]);
+        if(count > best_count) {
+            best = i;
+            best_count = count;
+        }
+    }
+    return best;
+}
+
+/*
+ *  Return how many times the state took the column in the profile.
+ */
+static inline unsigned long long count_of(machine_t *mac, int state, int col) {
+    return (NULL == mac->counts)? 0: mac->counts[state * mac->num_trans + col];
+}
+
+/*
+ *  Renumber the column classes so that the ones that the profile used the
+ *  most come first and are next to each other in the rows of the tables.
+ */
+static void sort_classes(machine_t *mac, int *classes, int count) {
+
+    unsigned long long *total;
+    int *order, *number, i, j, k;
+
+    total = calloc(count, sizeof(unsigned long long));
+    order = calloc(count, sizeof(int));
+    number = calloc(count, sizeof(int));
+    if(!total || !order || !number)
+        SERROR(FATAL_ERROR, "Cannot allocate the class order");
+
+    for(i = 0; i < mac->num_states; i++)
+        for(j = 0; j < mac->num_trans; j++)
+            total[classes[j]] += count_of(mac, i, j);
+
+    // insertion sort, so classes that were used the same keep their order
+    for(i = 0; i < count; i++) {
+        k = i;
+        for(j = i; j > 0 && total[order[j - 1]] < total[k]; j--)
+            order[j] = order[j - 1];
+        order[j] = k;
+    }
+    for(i = 0; i < count; i++)
+        number[order[i]] = i;
+    for(j = 0; j < mac->num_trans; j++)
+        classes[j] = number[classes[j]];
+
+    free(total);
+    free(order);
+    free(number);
+}
+
+/*
+ *  Number the transitions so that columns that have the same next state and
+ *  action in every row share a number.  The classes are numbered in the order
+ *  that their first column is seen.  Returns the number of classes.
+ */
+static int column_classes(machine_t *mac, int *classes) {
+
+    transition_t ***rows;
+    string_list_t *mlst;
+    int i, j, k, count = 0;
+
+    if(NULL == (rows = calloc(mac->num_states, sizeof(transition_t**))))
+        SERROR(FATAL_ERROR, "Cannot allocate the transition rows");
+
+    for(mlst = mac->states, i = 0; mlst != NULL; mlst = mlst->next, i++)
+        rows[i] = select_row(mac, select_state(mac, mlst->strg));
+
+    for(j = 0; j < mac->num_trans; j++) {
+        classes[j] = -1;
+        for(k = 0; k < j && classes[j] < 0; k++) {
+            for(i = 0; i < mac->num_states; i++)
+                if(!same_trans(rows[i][j], rows[i][k]))
+                    break;
+            if(i == mac->num_states)
+                classes[j] = classes[k];
+        }
+        if(classes[j] < 0)
+            classes[j] = count++;
+    }
+
+    for(i = 0; i < mac->num_states; i++)
+        free(rows[i]);
+    free(rows);
+    if(NULL != mac->counts)
+        sort_classes(mac, classes, count);
+    return count;
+}
+
+/*
+ *  Return the transition for every class of the state.  The first column of a
+ *  class stands for all of them.
+ */
+static transition_t **select_class_row(machine_t *mac, state_def_t *state, int *classes) {
+
+    transition_t **row = select_row(mac, state), **class_row;
+    int j;
+
+    if(NULL == (class_row = calloc(mac->num_trans, sizeof(transition_t*))))
+        SERROR(FATAL_ERROR, "Cannot allocate the class row");
+    for(j = mac->num_trans - 1; j >= 0; j--)
+        class_row[classes[j]] = row[j];
+
+    free(row);
+    return class_row;
+}
+
+static void emit_int_array(char *type, char *name, int *values, int count) {
+
+    int i;
+
+    // C does not allow an empty array
+    if(count == 0) {
+        fprintf(fp, "static const %s %s[1] = { 0 };\n\n", type, name);
+        return;
+    }
+
+    fprintf(fp, "static const %s %s[%d] = {", type, name, count);
+    for(i = 0; i < count; i++)
+        fprintf(fp, "%s%d", (i == 0)? "\n    ": (i % 16)? ", ": ",\n    ", values[i]);
+    fprintf(fp, "\n};\n\n");
+}
+
+/*
+ *  Otherwise the table is emitted at file scope as static const data, so it
+ *  is built by the compiler and shared by every call.  The next states and
+ *  the actions are kept in separate arrays using the narrowest type that will
+ *  hold them, so that the next state lookups are packed as tightly as they
+ *  can be.  The actions are indexes into the action table.  There is one
+ *  column for every class of transitions.
+ */
+static void emit_tables(machine_t *mac, int *classes, int num_classes) {
+
+    string_list_t *mlst;
+    transition_t **row;
+    int j;
+
+    fprintf(fp, "static const %s %s_next[%d][%d] = {\n",
+            index_type(mac->num_states + 2), mac->name, mac->num_states, num_classes);
+    for(mlst = mac->states; mlst != NULL; mlst = mlst->next) {
+        row = select_class_row(mac, select_state(mac, mlst->strg), classes);
+        fprintf(fp, "    {");
+        for(j = 0; j < num_classes; j++)
+            fprintf(fp, "%s_%s%s", mac->name, row[j]->state, (j < num_classes - 1)? ", ": "");
+        fprintf(fp, "}%s\n", (mlst->next != NULL)? ",": "");
+        free(row);
+    }
+    fprintf(fp, "};\n\n");
+
+    fprintf(fp, "static const %s %s_action[%d][%d] = {\n",
+            index_type(num_actions), mac->name, mac->num_states, num_classes);
+    for(mlst = mac->states; mlst != NULL; mlst = mlst->next) {
+        row = select_class_row(mac, select_state(mac, mlst->strg), classes);
+        fprintf(fp, "    {");
+        for(j = 0; j < num_classes; j++)
+            fprintf(fp, "%d%s", action_of(mac, row[j]), (j < num_classes - 1)? ", ": "");
+        fprintf(fp, "}%s\n", (mlst->next != NULL)? ",": "");
+        free(row);
+    }
+    fprintf(fp, "};\n");
+}
+
+/*
+ *  Emit the machine as a row displacement table.  Every row keeps the entry
+ *  that most of its columns use as the default, and the rest of the entries
+ *  are packed into one vector where rows may use the slots that other rows
+ *  leave empty.  The entry for a state and a transition is in the slot at
+ *  base[state] + class if check[slot] is the state, otherwise it is the
+ *  default of the state.
+ */
+static void emit_comb_tables(machine_t *mac, int *classes, int num_classes) {
+
+    string_list_t *mlst;
+    transition_t ***rows, *def;
+    int *base, *order, *def_next, *def_action, *count;
+    int *check = NULL, *comb_next = NULL, *comb_action = NULL;
+    int i, j, k, b, size = 0, last = 0, used = 0, dense, packed;
+    char name[300];
+
+    rows = calloc(mac->num_states, sizeof(transition_t**));
+    base = calloc(mac->num_states, sizeof(int));
+    order = calloc(mac->num_states, sizeof(int));
+    def_next = calloc(mac->num_states, sizeof(int));
+    def_action = calloc(mac->num_states, sizeof(int));
+    count = calloc(mac->num_states, sizeof(int));
+    if(!rows || !base || !order || !def_next || !def_action || !count)
+        SERROR(FATAL_ERROR, "Cannot allocate the comb table");
+
+    // find the default of every row and how many entries are left over
+    for(mlst = mac->states, i = 0; mlst != NULL; mlst = mlst->next, i++) {
+        rows[i] = select_class_row(mac, select_state(mac, mlst->strg), classes);
+        def = rows[i][most_common(rows[i], num_classes)];
+        def_next[i] = state_index(mac, def->state);
+        def_action[i] = action_of(mac, def);
+        for(j = 0; j < num_classes; j++) {
+            if(same_trans(rows[i][j], def))
+                rows[i][j] = NULL;
+            else
+                count[i]++;
+        }
+    }
+
+    // pack the fullest rows first
+    for(i = 0; i < mac->num_states; i++) {
+        for(j = i; j > 0 && count[order[j - 1]] < count[i]; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+
+    for(k = 0; k < mac->num_states; k++) {
+        i = order[k];
+        // a row never has to start past the rows that were placed before it,
+        // so every base is less than num_states * num_classes.
+        for(b = 0; ; b++) {
+            for(j = 0; j < num_classes; j++)
+                if(rows[i][j] != NULL && b + j < size && check[b + j] >= 0)
+                    break;
+            if(j == num_classes)
+                break;
+        }
+        base[i] = b;
+
+        if(b + num_classes > size) {
+            check = realloc(check, (b + num_classes) * sizeof(int));
+            comb_next = realloc(comb_next, (b + num_classes) * sizeof(int));
+            comb_action = realloc(comb_action, (b + num_classes) * sizeof(int));
+            if(!check || !comb_next || !comb_action)
+                SERROR(FATAL_ERROR, "Cannot allocate the comb table");
+            for(j = size; j < b + num_classes; j++) {
+                check[j] = -1;
+                comb_next[j] = 0;
+                comb_action[j] = 0;
+            }
+            size = b + num_classes;
+        }
+
+        for(j = 0; j < num_classes; j++) {
+            if(rows[i][j] != NULL) {
+                check[b + j] = i;
+                comb_next[b + j] = state_index(mac, rows[i][j]->state);
+                comb_action[b + j] = action_of(mac, rows[i][j]);
+                used++;
+            }
+        }
+    }
+
+    // empty slots are checked against a state that does not exist.  Only the
+    // check vector has to reach past the last slot that is used.
+    for(j = 0; j < size; j++) {
+        if(check[j] < 0)
+            check[j] = mac->num_states;
+        else
+            last = j + 1;
+    }
+
+    snprintf(name, sizeof(name), "%s_base", mac->name);
+    emit_int_array(index_type(mac->num_states * num_classes), name, base, mac->num_states);
+    snprintf(name, sizeof(name), "%s_default_next", mac->name);
+    emit_int_array(index_type(mac->num_states + 2), name, def_next, mac->num_states);
+    snprintf(name, sizeof(name), "%s_default_action", mac->name);
+    emit_int_array(index_type(num_actions), name, def_action, mac->num_states);
+    snprintf(name, sizeof(name), "%s_check", mac->name);
+    emit_int_array(index_type(mac->num_states + 1), name, check, size);
+    snprintf(name, sizeof(name), "%s_comb_next", mac->name);
+    emit_int_array(index_type(mac->num_states + 2), name, comb_next, last);
+    snprintf(name, sizeof(name), "%s_comb_action", mac->name);
+    emit_int_array(index_type(num_actions), name, comb_action, last);
+
+    dense = mac->num_states * num_classes *
+            (type_size(mac->num_states + 2) + type_size(num_actions));
+    packed = mac->num_states * (type_size(mac->num_states * num_classes) +
+            type_size(mac->num_states + 2) + type_size(num_actions)) +
+            size * type_size(mac->num_states + 1) +
+            last * (type_size(mac->num_states + 2) + type_size(num_actions));
+    printf("%s: comb table has %d slots for %d entries, %d bytes instead of %d (%d%%)\n",
+            mac->name, size, used, packed, dense, (packed * 100) / dense);
+
+    for(i = 0; i < mac->num_states; i++)
+        free(rows[i]);
+    free(rows);
+    free(base);
+    free(order);
+    free(def_next);
+    free(def_action);
+    free(count);
+    free(check);
+    free(comb_next);
+    free(comb_action);
+}
+
+static inline int is_comb(machine_t *mac) {
+    return (mac->layout != NULL && !strcmp(mac->layout, "comb"));
+}
+
+/*
+ *  Emit the map from the transitions to their classes, followed by the tables
+ *  of the machine with a column for each class.
+ */
+static void emit_class_table(machine_t *mac) {
+
+    int *classes, num_classes;
+    char name[300];
+
+    if(NULL == (classes = calloc(mac->num_trans, sizeof(int))))
+        SERROR(FATAL_ERROR, "Cannot allocate the transition classes");
+    num_classes = column_classes(mac, classes);
+    printf("%s: %d transitions in %d classes\n", mac->name, mac->num_trans, num_classes);
+
+    snprintf(name, sizeof(name), "%s_class", mac->name);
+    emit_int_array(index_type(num_classes), name, classes, mac->num_trans);
+    if(is_comb(mac))
+        emit_comb_tables(mac, classes, num_classes);
+    else
+        emit_tables(mac, classes, num_classes);
+
+    free(classes);
+}
+
+/*
+ *  Emit the local names that the table runners use for the shared tables.
+ */
+static void emit_table_aliases(machine_t *mac) {
+
+    int *classes, num_classes;
+
+    if(NULL == (classes = calloc(mac->num_trans, sizeof(int))))
+        SERROR(FATAL_ERROR, "Cannot allocate the transition classes");
+    num_classes = column_classes(mac, classes);
+    free(classes);
+
+    fprintf(fp, "    const %s *trans_class = %s_class;\n", index_type(num_classes), mac->name);
+    if(is_comb(mac)) {
+        fprintf(fp, "    const %s *base = %s_base;\n",
+                index_type(mac->num_states * num_classes), mac->name);
+        fprintf(fp, "    const %s *check = %s_check;\n",
+                index_type(mac->num_states + 1), mac->name);
+        fprintf(fp, "    const %s *comb_next = %s_comb_next;\n",
+                index_type(mac->num_states + 2), mac->name);
+        fprintf(fp, "    const %s *comb_action = %s_comb_action;\n",
+                index_type(num_actions), mac->name);
+        fprintf(fp, "    const %s *default_next = %s_default_next;\n",
+                index_type(mac->num_states + 2), mac->name);
+        fprintf(fp, "    const %s *default_action = %s_default_action;\n\n",
+                index_type(num_actions), mac->name);
+    }
+    else {
+        fprintf(fp, "    const %s (*next)[%d] = %s_next;\n",
+                index_type(mac->num_states + 2), num_classes, mac->name);
+        fprintf(fp, "    const %s (*action)[%d] = %s_action;\n\n",
+                index_type(num_actions), num_classes, mac->name);
+    }
+}
+
+/*
+ *  Return the first column of the row that does the same thing as each
+ *  column, so that columns that do the same thing can share code.
+ */
+static int *group_row(machine_t *mac, transition_t **row) {
+
+    int *group;
+    int i, j;
+
+    if(NULL == (group = calloc(mac->num_trans, sizeof(int))))
+        SERROR(FATAL_ERROR, "Cannot allocate the transition groups");
+
+    for(i = 0; i < mac->num_trans; i++)
+        for(j = 0; j <= i; j++)
+            if(same_trans(row[i], row[j])) {
+                group[i] = j;
+                break;
+            }
+
+    return group;
+}
+
+/*
+ *  Return the first column of every group in the order that the cases are
+ *  emitted.  Without a profile that is the order of the columns, otherwise
+ *  the groups that were taken the most come first.  The total of the row is
+ *  returned in total.
+ */
+static int *case_order(machine_t *mac, char *name, int *group, int *num, unsigned long long *total) {
+
+    unsigned long long *counts;
+    int *order, state = state_index(mac, name), i, j;
+
+    order = calloc(mac->num_trans, sizeof(int));
+    counts = calloc(mac->num_trans, sizeof(unsigned long long));
+    if(!order || !counts)
+        SERROR(FATAL_ERROR, "Cannot allocate the case order");
+
+    *total = 0;
+    for(i = 0; i < mac->num_trans; i++) {
+        counts[group[i]] += count_of(mac, state, i);
+        *total += count_of(mac, state, i);
+    }
+
+    // insertion sort, so groups that were used the same keep their order
+    for(i = 0, *num = 0; i < mac->num_trans; i++) {
+        if(group[i] != i)
+            continue;
+        for(j = (*num)++; j > 0 && counts[order[j - 1]] < counts[i]; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+
+    free(counts);
+    return order;
+}
+
+/*
+ *  Return the column that the profile says the state takes the most, or -1
+ *  when there is no profile for the state.
+ */
+static int hot_column(machine_t *mac, char *name) {
+
+    int state = state_index(mac, name), i, hot = -1;
+
+    for(i = 0; i < mac->num_trans; i++)
+        if(count_of(mac, state, i) > 0 && (hot < 0 || count_of(mac, state, i) > count_of(mac, state, hot)))
+            hot = i;
+    return hot;
+}
+
+/*
+ *  Emit the switch on the transition, with a hint for the hot column.
+ */
+static void emit_case_switch(machine_t *mac, char *name, char *indent) {
+
+    int hot = hot_column(mac, name);
+
+    if(hot < 0)
+        fprintf(fp, "%sswitch(trans) {\n", indent);
+    else
+        fprintf(fp, "%sswitch(SM_EXPECT(trans, %d)) {\n", indent, hot);
+}
+
+static void emit_switch_case(machine_t *mac, char *state, transition_t *tran) {
+
+    fprintf(fp, "                        PRINT_TRANS(%s, \"%s\", %s);\n", state, tran->func, tran->state);
+    if(!is_nop(mac, tran->func))
+        fprintf(fp, "                        %s(%s);\n", tran->func, ctx_arg);
+    if(strcmp(state, tran->state))
+        fprintf(fp, "                        state = %s;\n", tran->state);
+    fprintf(fp, "                        break;\n");
+}
+
+/*
+ *  Emit one state as a switch on the transition.  Columns that do the same
+ *  thing share a case and the most common one becomes the default.  The
+ *  actions are called directly so that the compiler can inline them.
+ */
+static void emit_switch_state(machine_t *mac, char *name) {
+
+    state_def_t *state = select_state(mac, name);
+    transition_t **row = select_row(mac, state);
+    int *group = group_row(mac, row), *order;
+    string_list_t *tlst;
+    unsigned long long total;
+    int i, j, k, num, best;
+
+    best = group[most_common(row, mac->num_trans)];
+    order = case_order(mac, name, group, &num, &total);
+
+    fprintf(fp, "            case %s:\n", name);
+    emit_case_switch(mac, name, "                ");
+    for(k = 0; k < num; k++) {
+        if((i = order[k]) == best)
+            continue;
+        for(j = 0, tlst = mac->trans; j < mac->num_trans; j++, tlst = tlst->next)
+            if(group[j] == i)
+                fprintf(fp, "                    case %d: // %s\n", j, tlst->strg);
+        emit_switch_case(mac, name, row[i]);
+    }
+    fprintf(fp, "                    default:\n");
+    emit_switch_case(mac, name, row[best]);
+    fprintf(fp, "                }\n");
+    fprintf(fp, "                break;\n");
+
+    free(order);
+    free(group);
+    free(row);
+}
+
+static void emit_switch(machine_t *mac) {
+
+    string_list_t *mlst;
+
+    emit_runner(switch_runner, mac);
+    for(mlst = mac->states; mlst != NULL; mlst = mlst->next)
+        emit_switch_state(mac, mlst->strg);
+    emit_section(switch_runner_end);
+}
+
+static void emit_goto_jump(machine_t *mac, char *name) {
+
+    transition_t **row = select_row(mac, select_state(mac, name));
+    int *group = group_row(mac, row);
+    int i;
+
+    fprintf(fp, "    static void *const %s_jump[%d] = {", name, mac->num_trans);
+    for(i = 0; i < mac->num_trans; i++)
+        fprintf(fp, "%s&&t_%s_%d", (i == 0)? "\n        ": (i % 6)? ", ": ",\n        ",
+                name, group[i]);
+    fprintf(fp, "\n    };\n");
+
+    free(group);
+    free(row);
+}
+
+/*
+ *  Every state has a label that reads the input and jumps through the jump
+ *  table of the state.  Every group of columns has a label that runs the
+ *  action and then jumps straight to the next state.
+ */
+static void emit_goto_state(machine_t *mac, char *name) {
+
+    transition_t **row = select_row(mac, select_state(mac, name));
+    int *group = group_row(mac, row), *order;
+    unsigned long long total, count;
+    int i, j, k, num;
+
+    order = case_order(mac, name, group, &num, &total);
+
+    fprintf(fp, "s_%s: __attribute__((unused));\n", name);
+    fprintf(fp, "    trans = %s;\n", read_input(mac));
+    emit_hooks("    ", mac, name);
+    fprintf(fp, "    goto *%s_jump[trans];\n", name);
+    for(k = 0; k < num; k++) {
+        i = order[k];
+        for(j = 0, count = 0; j < mac->num_trans; j++)
+            if(group[j] == i)
+                count += count_of(mac, state_index(mac, name), j);
+        // the groups that the profile took less than one time in a hundred
+        if(NULL != mac->counts && (total == 0 || count * 100 < total))
+            fprintf(fp, "t_%s_%d: SM_COLD;\n", name, i);
+        else
+            fprintf(fp, "t_%s_%d:\n", name, i);
+        fprintf(fp, "    PRINT_TRANS(%s, \"%s\", %s);\n", name, row[i]->func, row[i]->state);
+        if(!is_nop(mac, row[i]->func))
+            fprintf(fp, "    %s(%s);\n", row[i]->func, ctx_arg);
+        if(!strcmp(row[i]->state, "END") || !strcmp(row[i]->state, "ERROR")) {
+            fprintf(fp, "    state = %s;\n", row[i]->state);
+            fprintf(fp, "    goto done;\n");
+        }
+        else
+            fprintf(fp, "    goto s_%s;\n", row[i]->state);
+    }
+
+    free(order);
+    free(group);
+    free(row);
+}
+
+/*
+ *  The computed goto backend needs the GCC "labels as values" extension.  The
+ *  switch backend is emitted as well for other compilers.
+ */
+static void emit_goto(machine_t *mac) {
+
+    string_list_t *mlst;
+
+    fprintf(fp, "#if defined(__GNUC__)\n");
+    for(mlst = mac->states; mlst != NULL; mlst = mlst->next)
+        emit_goto_jump(mac, mlst->strg);
+    fprintf(fp, "    int state, trans;\n\n");
+    fprintf(fp, "    PRINT(\"\\nSM %%s() ENTER\\n\", __func__);\n");
+    for(mlst = mac->states; mlst != NULL; mlst = mlst->next)
+        emit_goto_state(mac, mlst->strg);
+    fprintf(fp, "done:\n");
+    fprintf(fp, "    PRINT(\"SM %%s() RETURNING\\n\", __func__);\n");
+    fprintf(fp, "#else\n");
+    emit_switch(mac);
+    fprintf(fp, "#endif\n\n");
+}
+
+static void emit_tail_case(machine_t *mac, char *state, transition_t *tran) {
+
+    fprintf(fp, "            PRINT_TRANS(%s_%s, \"%s\", %s_%s);\n",
+            mac->name, state, tran->func, mac->name, tran->state);
+    if(!is_nop(mac, tran->func))
+        fprintf(fp, "            %s(%s);\n", tran->func, ctx_arg);
+    if(!strcmp(tran->state, "END") || !strcmp(tran->state, "ERROR"))
+        fprintf(fp, "            return (tail_t){NULL, %s_%s};\n", mac->name, tran->state);
+    else
+        fprintf(fp, "            TAIL_CALL(tail_%s_%s);\n", mac->name, tran->state);
+}
+
+/*
+ *  Every state is its own function that reads the input, runs the action and
+ *  then tail calls the function of the next state.  The state lives in the
+ *  program counter and the compiler allocates registers for each state on its
+ *  own.
+ */
+static void emit_tail_state(machine_t *mac, char *name) {
+
+    state_def_t *state = select_state(mac, name);
+    transition_t **row = select_row(mac, state);
+    int *group = group_row(mac, row), *order;
+    string_list_t *tlst;
+    unsigned long long total;
+    char buf[600];
+    int i, j, k, num, best;
+
+    best = group[most_common(row, mac->num_trans)];
+    order = case_order(mac, name, group, &num, &total);
+
+    fprintf(fp, "static tail_t tail_%s_%s(%s) {\n\n", mac->name, name, ctx_param);
+    fprintf(fp, "    int trans = %s;\n", read_input(mac));
+    snprintf(buf, sizeof(buf), "%s_%s", mac->name, name);
+    emit_hooks("    ", mac, buf);
+    emit_case_switch(mac, name, "    ");
+    for(k = 0; k < num; k++) {
+        if((i = order[k]) == best)
+            continue;
+        for(j = 0, tlst = mac->trans; j < mac->num_trans; j++, tlst = tlst->next)
+            if(group[j] == i)
+                fprintf(fp, "        case %d: // %s\n", j, tlst->strg);
+        emit_tail_case(mac, name, row[i]);
+    }
+    fprintf(fp, "        default:\n");
+    emit_tail_case(mac, name, row[best]);
+    fprintf(fp, "    }\n");
+    fprintf(fp, "}\n\n");
+
+    free(order);
+    free(group);
+    free(row);
+}
+
+static void emit_tail_states(machine_t *mac) {
+
+    string_list_t *mlst;
+
+    for(mlst = mac->states; mlst != NULL; mlst = mlst->next)
+        fprintf(fp, "static tail_t tail_%s_%s(%s);\n", mac->name, mlst->strg, ctx_param);
+    fprintf(fp, "\n");
+    for(mlst = mac->states; mlst != NULL; mlst = mlst->next)
+        emit_tail_state(mac, mlst->strg);
+}
+
+static void emit_tail(machine_t *mac) {
+
+    fprintf(fp, "    tail_t tail = {tail_%s_START, 0};\n\n", mac->name);
+    fprintf(fp, "    PRINT(\"\\nSM %%s() ENTER\\n\", __func__);\n");
+    fprintf(fp, "    while(tail.next != NULL)\n");
+    fprintf(fp, "        tail = tail.next(%s);\n", ctx_arg);
+    fprintf(fp, "    int state = tail.state;\n");
+    fprintf(fp, "    PRINT(\"SM %%s() RETURNING\\n\", __func__);\n\n");
+}
+
+/*
+ *  Emit the state names for a machine.  The prefix is used to keep the names
+ *  of different machines apart when they are emitted at file scope.
+ */
+static void emit_state_enum(machine_t *mac, char *indent, char *prefix) {
+
+    string_list_t *lst;
+
+    fprintf(fp, "%senum { ", indent);
+    for(lst = mac->states; lst != NULL; lst = lst->next)
+        fprintf(fp, "%s%s, ", prefix, lst->strg);
+    fprintf(fp, "%sEND, %sERROR, };\n\n", prefix, prefix);
+}
+
+/*
+ *  The transition of every byte for a machine with character sets.  The
+ *  value is the column of the transition, the same as the input function of
+ *  other machines returns.
+ */
+static void emit_chars_table(machine_t *mac) {
+
+    int values[256], c;
+    char name[300];
+
+    for(c = 0; c < 256; c++)
+        values[c] = mac->chars[c];
+    snprintf(name, sizeof(name), "%s_chars", mac->name);
+    emit_int_array(index_type(mac->num_trans), name, values, 256);
+}
+
+/*
+ *  The counters of the instrumented build.  There is a counter for every
+ *  state and transition of every machine, and dump_counters() prints the ones
+ *  that were used as "machine state transition count" lines.  Everything is
+ *  inside of INSTRUMENT so that the counters compile out like PRINT does.
+ */
+static void emit_counters(machine_t *machine) {
+
+    machine_t *mac;
+
+    fprintf(fp, "//#define INSTRUMENT\n\n");
+    fprintf(fp, "#ifdef INSTRUMENT\n");
+    fprintf(fp, "#include <stdio.h>\n");
+    fprintf(fp, "#include <inttypes.h>\n\n");
+    fprintf(fp, "#define COUNT(name, state, trans) (name##_counts[state][trans]++)\n\n");
+    for(mac = machine; mac != NULL; mac = mac->next) {
+        fprintf(fp, "static uint64_t %s_counts[%d][%d];\n", mac->name, mac->num_states, mac->num_trans);
+    }
+    fprintf(fp, "\n");
+
+    fprintf(fp, "static void dump_counters(FILE *out) {\n\n");
+    fprintf(fp, "    int state, trans;\n\n");
+    fprintf(fp, "    fprintf(out, \"# machine state transition count\\n\");\n");
+    for(mac = machine; mac != NULL; mac = mac->next) {
+        fprintf(fp, "    for(state = 0; state < %d; state++)\n", mac->num_states);
+        fprintf(fp, "        for(trans = 0; trans < %d; trans++)\n", mac->num_trans);
+        fprintf(fp, "            if(%s_counts[state][trans] != 0)\n", mac->name);
+        fprintf(fp, "                fprintf(out, \"%s %%s %%s %%\" PRIu64 \"\\n\", %s_state_names[state],\n",
+                mac->name, mac->name);
+        fprintf(fp, "                        %s_trans_names[trans], %s_counts[state][trans]);\n", mac->name, mac->name);
+    }
+    fprintf(fp, "}\n");
+    fprintf(fp, "#else\n");
+    fprintf(fp, "#  define COUNT(name, state, trans)\n");
+    fprintf(fp, "#endif\n\n");
+}
+
+/*
+ *  Return true if any of the machines were given counters by a profile.
+ */
+static int is_profiled(machine_t *machine) {
+
+    for(; machine != NULL; machine = machine->next)
+        if(NULL != machine->counts)
+            return 1;
+    return 0;
+}
+
+/*
+ *  The tracer writes a small binary record for every transition into a ring
+ *  that every thread has its own copy of, so nothing is locked and nothing is
+ *  formatted while the machines run.  It is only compiled when TRACE is
+ *  defined, and the decoder turns what sm_trace_dump() wrote into text.
+ */
+static void emit_tracer(void) {
+
+    fprintf(fp, "//#define TRACE\n\n");
+    fprintf(fp, "#ifdef TRACE\n");
+    fprintf(fp, "#include <stdio.h>\n");
+    fprintf(fp, "#include <stdint.h>\n\n");
+    emit_section(trace_record_part);
+    emit_section(trace_ring_part);
+    fprintf(fp, "#else\n");
+    fprintf(fp, "#  define RECORD(name, state, trans)\n");
+    fprintf(fp, "#endif\n\n");
+}
+
+/*
+ *  Emit the names that the decoder needs for one machine.  The action and
+ *  the next state are looked up from the state and the transition, so they
+ *  do not have to be in the records.
+ */
+static void emit_decoder_tables(machine_t *mac) {
+
+    string_list_t *mlst, *tlst;
+    transition_t **row;
+    int i;
+
+    fprintf(fp, "static const char *const %s_states[%d] = {", mac->name, mac->num_states);
+    for(mlst = mac->states; mlst != NULL; mlst = mlst->next)
+        fprintf(fp, " \"%s\",", mlst->strg);
+    fprintf(fp, " };\n");
+    fprintf(fp, "static const char *const %s_trans[%d] = {", mac->name, mac->num_trans);
+    for(tlst = mac->trans; tlst != NULL; tlst = tlst->next)
+        fprintf(fp, " \"%s\",", tlst->strg);
+    fprintf(fp, " };\n");
+
+    fprintf(fp, "static const char *const %s_action[%d] = {\n", mac->name, mac->num_states * mac->num_trans);
+    for(mlst = mac->states; mlst != NULL; mlst = mlst->next) {
+        row = select_row(mac, select_state(mac, mlst->strg));
+        fprintf(fp, "   ");
+        for(i = 0; i < mac->num_trans; i++)
+            fprintf(fp, " \"%s\",", is_nop(mac, row[i]->func)? "nop": row[i]->func);
+        fprintf(fp, "\n");
+        free(row);
+    }
+    fprintf(fp, "};\n");
+
+    fprintf(fp, "static const char *const %s_next[%d] = {\n", mac->name, mac->num_states * mac->num_trans);
+    for(mlst = mac->states; mlst != NULL; mlst = mlst->next) {
+        row = select_row(mac, select_state(mac, mlst->strg));
+        fprintf(fp, "   ");
+        for(i = 0; i < mac->num_trans; i++)
+            fprintf(fp, " \"%s\",", row[i]->state);
+        fprintf(fp, "\n");
+        free(row);
+    }
+    fprintf(fp, "};\n\n");
+}
+
+/*
+ *  Emit a program on its own that decodes the records of the tracer.
+ */
+static void emit_decoder(machine_t *machine, char *name) {
+
+    machine_t *mac;
+    FILE *out = fp;
+    int count = 0;
+
+    if(NULL == (fp = fopen(name, "w")))
+        SERROR(FILE_ERROR, "Cannot open the decoder file \"%s\": ", name);
+
+    fprintf(fp, "/*\n");
+    fprintf(fp, " *  Decodes what sm_trace_dump() wrote, as text.  Build it on its own and\n");
+    fprintf(fp, " *  run it on the dump, or on stdin.  It must be generated from the same\n");
+    fprintf(fp, " *  definition as the machines that wrote the dump.\n");
+    fprintf(fp, " */\n");
+    fprintf(fp, "#include <stdio.h>\n");
+    fprintf(fp, "#include <stdint.h>\n");
+    fprintf(fp, "#include <inttypes.h>\n\n");
+    emit_section(trace_record_part);
+
+    for(mac = machine; mac != NULL; mac = mac->next, count++)
+        emit_decoder_tables(mac);
+
+    fprintf(fp, "typedef struct {\n");
+    fprintf(fp, "    const char *name;\n");
+    fprintf(fp, "    int num_states;\n");
+    fprintf(fp, "    int num_trans;\n");
+    fprintf(fp, "    const char *const *states;\n");
+    fprintf(fp, "    const char *const *trans;\n");
+    fprintf(fp, "    const char *const *action;\n");
+    fprintf(fp, "    const char *const *next;\n");
+    fprintf(fp, "} sm_trace_tables_t;\n\n");
+    fprintf(fp, "#define SM_TRACE_MACHINES %d\n", count);
+    fprintf(fp, "static const sm_trace_tables_t sm_trace_tables[SM_TRACE_MACHINES] = {\n");
+    for(mac = machine; mac != NULL; mac = mac->next)
+        fprintf(fp, "    {\"%s\", %d, %d, %s_states, %s_trans, %s_action, %s_next},\n",
+                mac->name, mac->num_states, mac->num_trans, mac->name, mac->name, mac->name, mac->name);
+    fprintf(fp, "};\n\n");
+    emit_section(decoder_part);
+
+    fclose(fp);
+    fp = out;
+}
+
+static void emit_machine(machine_t *machine) {
+
+    machine_t *mac;
+    char prefix[256];
+
+    // emit the machine protos
+    for(mac = machine; mac != NULL; mac = mac->next)
+        fprintf(fp, "static int %s(%s);\n", mac->name, ctx_param);
+    fprintf(fp, "\n\n");
+
+    // emit the byte tables of the machines that have character sets
+    for(mac = machine; mac != NULL; mac = mac->next)
+        if(NULL != mac->chars && chars_owner(mac) == mac)
+            emit_chars_table(mac);
+    if(opts->instrument)
+        emit_counters(machine);
+    if(NULL != opts->trace)
+        emit_tracer();
+
+    // emit the shared tables
+    if(opts->backend == BACKEND_TABLE) {
+        emit_action_table();
+        for(mac = machine; mac != NULL; mac = mac->next) {
+            snprintf(prefix, sizeof(prefix), "%s_", mac->name);
+            emit_state_enum(mac, "", prefix);
+            emit_class_table(mac);
+            fprintf(fp, "\n");
+        }
+        fprintf(fp, "\n");
+    }
+    else if(opts->backend == BACKEND_SWITCH || opts->backend == BACKEND_GOTO) {
+        emit_section(trace_part);
+        if(is_profiled(machine))
+            emit_section(profile_part);
+    }
+    else if(opts->backend == BACKEND_TAIL) {
+        emit_section(trace_part);
+        if(is_profiled(machine))
+            emit_section(profile_part);
+        emit_section(tail_part);
+        for(mac = machine; mac != NULL; mac = mac->next) {
+            snprintf(prefix, sizeof(prefix), "%s_", mac->name);
+            emit_state_enum(mac, "", prefix);
+            emit_tail_states(mac);
+            fprintf(fp, "\n");
+        }
+    }
+
+    // emit all of the machine definitions
+    for(mac = machine; mac != NULL; mac = mac->next) {
+        fprintf(fp, "static int %s(%s) {\n\n", mac->name, ctx_param);
+
+        emit_state_enum(mac, "    ", "");
+/*
+fprintf(fp, "// ");
+for(lst = mac->trans; lst != NULL; lst = lst->next)
+    fprintf(fp, "%s, ", lst->strg);
+fprintf(fp, "\n\n");
+*/
+        if(opts->backend == BACKEND_STACK)
+            emit_states(mac);
+        else if(opts->backend == BACKEND_TABLE)
+            emit_table_aliases(mac);
+
+        emit_nop_refs(mac);
+        if(mac->precode)
+            fprintf(fp, "    %s(%s);\n", mac->precode, ctx_arg);
+        if(opts->backend == BACKEND_STACK)
+            emit_runner(runner, mac);
+        else if(opts->backend == BACKEND_SWITCH)
+            emit_switch(mac);
+        else if(opts->backend == BACKEND_GOTO)
+            emit_goto(mac);
+        else if(opts->backend == BACKEND_TAIL)
+            emit_tail(mac);
+        else if(is_comb(mac))
+            emit_runner(comb_runner, mac);
+        else
+            emit_runner(table_runner, mac);
+        //fprintf(fp, "    RUN_STATE(%s, %s_states);\n", mac->input, mac->name);
+        if(mac->postcode)
+            fprintf(fp, "    %s(%s);\n", mac->postcode, ctx_arg);
+        fprintf(fp, "    return (state == END)? 0: -1;\n");
+        fprintf(fp, "}\n\n\n");
+    }
+}
+
+/*
+ *  Return the number of the machine with the name, or -1 if the name is not a
+ *  machine.  Machines are numbered in the order that they are emitted.
+ */
+static int machine_number(machine_t *machine, char *name) {
+
+    machine_t *mac;
+    int i;
+
+    for(mac = machine, i = 0; mac != NULL; mac = mac->next, i++) {
+        if(!strcmp(mac->name, name))
+            return i;
+    }
+    return -1;
+}
+
+static char *frame_part[] = {
+    "#include <stddef.h>",
+    "",
+    "#ifndef SM_STACK_DEPTH",
+    "#  define SM_STACK_DEPTH 64",
+    "#endif",
+    "",
+    "enum { SM_DONE = 0, SM_FAIL = -1, SM_MORE = 1 };",
+    "",
+    "// a machine that is running and the state that it is in.",
+    "typedef struct {",
+    "    int machine;",
+    "    int state;",
+    "} sm_frame_t;",
+    "",
+    "// the machines that are running, innermost last.",
+    "typedef struct {",
+    "    int depth;",
+    "    int max_depth;",
+    "    int result;",
+    "    size_t used;",
+    "    sm_frame_t frames[SM_STACK_DEPTH];",
+    "} sm_stack_t;",
+    "",
+    NULL
+};
+
+/*
+ *  Emit the code that enters a machine or leaves it, running its pre_code
+ *  or post_code.
+ */
+static void emit_frame_edge(machine_t *machine, char *name, int enter, char *param, char *arg) {
+
+    machine_t *mac;
+
+    fprintf(fp, "static int %s(sm_stack_t *stack, int machine%s) {\n\n", name, param);
+    if(enter) {
+        fprintf(fp, "    if(stack->depth >= SM_STACK_DEPTH) {\n");
+        fprintf(fp, "        PRINT(\"SM stack overflow\\n\");\n");
+        fprintf(fp, "        return 0;\n");
+        fprintf(fp, "    }\n");
+        fprintf(fp, "    stack->frames[stack->depth].machine = machine;\n");
+        fprintf(fp, "    stack->frames[stack->depth].state = 0;\n");
+        fprintf(fp, "    if(++stack->depth > stack->max_depth)\n");
+        fprintf(fp, "        stack->max_depth = stack->depth;\n");
+    }
+    fprintf(fp, "    switch(machine) {\n");
+    for(mac = machine; mac != NULL; mac = mac->next) {
+        if(NULL == (enter? mac->precode: mac->postcode))
+            continue;
+        fprintf(fp, "        case SM_%s:\n", mac->name);
+        fprintf(fp, "            %s(%s);\n", enter? mac->precode: mac->postcode, arg);
+        fprintf(fp, "            break;\n");
+    }
+    fprintf(fp, "    }\n");
+    if(!enter)
+        fprintf(fp, "    stack->depth--;\n");
+    fprintf(fp, "    return 1;\n");
+    fprintf(fp, "}\n\n");
+}
+
+/*
+ *  Emit what the push API and the stack runner share.  The machines are
+ *  numbered, and an action that names a machine is found in sm_call.
+ */
+static void emit_frames(machine_t *machine, char *param, char *arg) {
+
+    machine_t *mac;
+    int i, num, *call;
+
+    emit_section(frame_part);
+
+    for(mac = machine, num = 0; mac != NULL; mac = mac->next)
+        num++;
+
+    // END and ERROR are the last two states of every machine
+    fprintf(fp, "static const int sm_end[%d] = {", num);
+    for(mac = machine; mac != NULL; mac = mac->next)
+        fprintf(fp, " %s_END,", mac->name);
+    fprintf(fp, " };\n\n");
+
+    // the machine that an action starts, plus one.  0 is not a machine.
+    if(NULL == (call = calloc(num_actions, sizeof(int))))
+        SERROR(FATAL_ERROR, "Cannot allocate the call table");
+    for(i = 1; i < num_actions; i++)
+        call[i] = machine_number(machine, action_list[i]) + 1;
+    emit_int_array(index_type(num + 1), "sm_call", call, num_actions);
+    free(call);
+
+    emit_frame_edge(machine, "sm_enter", 1, param, arg);
+    emit_frame_edge(machine, "sm_leave", 0, param, arg);
+}
+
+/*
+ *  Emit the lookup of the next state and action of one machine from the
+ *  frame on top of the stack.  It uses the same tables as the table backend.
+ *  The transition comes from the classify function when the data is pushed
+ *  and from the input function otherwise.
+ */
+static void emit_frame_lookup(machine_t *mac, int push, char *arg) {
+
+    fprintf(fp, "            case SM_%s:\n", mac->name);
+    if(push && NULL != mac->chars)
+        fprintf(fp, "                trans = %s_chars[data[i]];\n", chars_owner(mac)->name);
+    else if(push)
+        fprintf(fp, "                trans = %s(%s%sdata[i]);\n", mac->classify, arg, (*arg)? ", ": "");
+    else
+        fprintf(fp, "                trans = %s;\n", read_input(mac));
+    emit_hooks("                ", mac, "f->state");
+    fprintf(fp, "                col = %s_class[trans];\n", mac->name);
+    if(is_comb(mac)) {
+        fprintf(fp, "                slot = %s_base[f->state] + col;\n", mac->name);
+        fprintf(fp, "                if(%s_check[slot] == f->state) {\n", mac->name);
+        fprintf(fp, "                    func = %s_comb_action[slot];\n", mac->name);
+        fprintf(fp, "                    next = %s_comb_next[slot];\n", mac->name);
+        fprintf(fp, "                }\n");
+        fprintf(fp, "                else {\n");
+        fprintf(fp, "                    func = %s_default_action[f->state];\n", mac->name);
+        fprintf(fp, "                    next = %s_default_next[f->state];\n", mac->name);
+        fprintf(fp, "                }\n");
+    }
+    else {
+        fprintf(fp, "                func = %s_action[f->state][col];\n", mac->name);
+        fprintf(fp, "                next = %s_next[f->state][col];\n", mac->name);
+    }
+    fprintf(fp, "                break;\n");
+}
+
+/*
+ *  Emit one step of the machine on top of the stack.  A machine that is named
+ *  as an action is pushed instead of being called, and every machine that
+ *  has finished is popped, keeping the result of the outermost one.
+ */
+static void emit_frame_step(machine_t *machine, int push, char *arg) {
+
+    machine_t *mac;
+
+    fprintf(fp, "        sm_frame_t *f = &stack->frames[stack->depth - 1];\n");
+    fprintf(fp, "        int trans = 0, col, slot, func = 0, next = 0;\n\n");
+    fprintf(fp, "        (void)slot;\n");
+    fprintf(fp, "        (void)col;\n");
+    fprintf(fp, "        switch(f->machine) {\n");
+    for(mac = machine; mac != NULL; mac = mac->next)
+        emit_frame_lookup(mac, push, arg);
+    fprintf(fp, "        }\n");
+    fprintf(fp, "        PRINT(\"machine = %%d: state = %%d: trans = %%d => func: %%s state: %%d\\n\",\n");
+    fprintf(fp, "                f->machine, f->state, trans, sm_action_names[func], next);\n");
+    fprintf(fp, "        f->state = next;\n");
+    fprintf(fp, "        if(sm_call[func] != 0) {\n");
+    fprintf(fp, "            if(!sm_enter(stack, sm_call[func] - 1%s%s)) {\n", (*arg)? ", ": "", arg);
+    fprintf(fp, "                stack->result = SM_FAIL;\n");
+    fprintf(fp, "                stack->depth = 0;\n");
+    fprintf(fp, "            }\n");
+    fprintf(fp, "        }\n");
+    fprintf(fp, "        else if(func != 0)\n");
+    fprintf(fp, "            (*actions[func])(%s);\n\n", arg);
+    fprintf(fp, "        // leave every machine that has finished\n");
+    fprintf(fp, "        while(stack->depth > 0) {\n");
+    fprintf(fp, "            f = &stack->frames[stack->depth - 1];\n");
+    fprintf(fp, "            if(f->state < sm_end[f->machine])\n");
+    fprintf(fp, "                break;\n");
+    fprintf(fp, "            if(stack->depth == 1)\n");
+    fprintf(fp, "                stack->result = (f->state == sm_end[f->machine])? SM_DONE: SM_FAIL;\n");
+    fprintf(fp, "            sm_leave(stack, f->machine%s%s);\n", (*arg)? ", ": "", arg);
+    fprintf(fp, "        }\n");
+}
+
+static char *skip_part[] = {
+    "#if defined(__AVX2__)",
+    "#  include <immintrin.h>",
+    "#elif defined(__SSE2__)",
+    "#  include <emmintrin.h>",
+    "#endif",
+    "",
+    "// the bytes that a state loops on without an action, and the ones that",
+    "// leave it if there are few enough of them to search for.",
+    "typedef struct {",
+    "    int num_stops;  // -1 when there are more than SM_SKIP_STOPS",
+    "    unsigned char stops[SM_SKIP_STOPS];",
+    "    unsigned char stay[256];",
+    "} sm_skip_t;",
+    "",
+    NULL
+};
+
+// the most bytes that leave a state that are searched for with vectors
+#define SKIP_STOPS 4
+
+/*
+ *  The search for the next byte that leaves the state.  The vector loops only
+ *  find the block that it is in and the byte loop finds the byte, so the
+ *  result is the same with or without them.
+ */
+static char *skip_search_part[] = {
+    "    if(skip->num_stops >= 0) {",
+    "#if defined(__AVX2__)",
+    "        __m256i stops[SM_SKIP_STOPS];",
+    "        int k;",
+    "",
+    "        for(k = 0; k < skip->num_stops; k++)",
+    "            stops[k] = _mm256_set1_epi8((char)skip->stops[k]);",
+    "        for(; i + 32 <= len; i += 32) {",
+    "            __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));",
+    "            __m256i hit = _mm256_setzero_si256();",
+    "",
+    "            for(k = 0; k < skip->num_stops; k++)",
+    "                hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, stops[k]));",
+    "            if(_mm256_movemask_epi8(hit) != 0)",
+    "                break;",
+    "        }",
+    "#elif defined(__SSE2__)",
+    "        __m128i stops[SM_SKIP_STOPS];",
+    "        int k;",
+    "",
+    "        for(k = 0; k < skip->num_stops; k++)",
+    "            stops[k] = _mm_set1_epi8((char)skip->stops[k]);",
+    "        for(; i + 16 <= len; i += 16) {",
+    "            __m128i v = _mm_loadu_si128((const __m128i *)(data + i));",
+    "            __m128i hit = _mm_setzero_si128();",
+    "",
+    "            for(k = 0; k < skip->num_stops; k++)",
+    "                hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, stops[k]));",
+    "            if(_mm_movemask_epi8(hit) != 0)",
+    "                break;",
+    "        }",
+    "#endif",
+    "    }",
+    "    while(i < len && skip->stay[data[i]])",
+    "        i++;",
+    NULL
+};
+
+/*
+ *  Return true if the state goes back to itself without an action for any
+ *  of its transitions.  Only these states are looked at when skipping, and
+ *  only in the machines with character sets, since the bytes that a classify
+ *  function sends to each transition are not known until it runs.
+ */
+static int loops_in_place(machine_t *mac, int index) {
+
+    transition_t **row;
+    string_list_t *lst;
+    int i, j, found = 0;
+
+    if(NULL == mac->chars)
+        return 0;
+    for(lst = mac->states, i = 0; i < index; lst = lst->next, i++)
+        ;
+    row = select_row(mac, select_state(mac, lst->strg));
+    for(j = 0; j < mac->num_trans && !found; j++)
+        found = (state_index(mac, row[j]->state) == index && action_of(mac, row[j]) == 0);
+    free(row);
+    return found;
+}
+
+/*
+ *  Emit the bytes that keep the state where it is without an action, and the
+ *  ones that leave it if there are few enough of them.
+ */
+static void emit_skip_state(machine_t *mac, int index) {
+
+    transition_t **row, *tran;
+    string_list_t *lst;
+    unsigned char stay[256], stops[SKIP_STOPS];
+    int i, c, num_stops = 0;
+
+    for(lst = mac->states, i = 0; i < index; lst = lst->next, i++)
+        ;
+    row = select_row(mac, select_state(mac, lst->strg));
+    for(c = 0; c < 256; c++) {
+        tran = row[mac->chars[c]];
+        stay[c] = (state_index(mac, tran->state) == index && action_of(mac, tran) == 0);
+        if(stay[c] || num_stops < 0)
+            continue;
+        if(num_stops < SKIP_STOPS)
+            stops[num_stops++] = (unsigned char)c;
+        else
+            num_stops = -1;
+    }
+    free(row);
+
+    fprintf(fp, "    {   // %s %s\n", mac->name, lst->strg);
+    fprintf(fp, "        %d, {", num_stops);
+    for(i = 0; i < SKIP_STOPS; i++)
+        fprintf(fp, "%s%d", (i == 0)? "": ", ", (i < num_stops)? stops[i]: 0);
+    fprintf(fp, "}, {");
+    for(c = 0; c < 256; c++)
+        fprintf(fp, "%s%d", (c == 0)? "\n            ": (c % 32)? ", ": ",\n            ", stay[c]);
+    fprintf(fp, "\n        }\n    },\n");
+}
+
+/*
+ *  A state that loops on itself without an action for most of the bytes, like
+ *  the body of a comment, can be run by searching for the next byte that
+ *  leaves it.  The bytes that stay are found here from the character sets, so
+ *  the tables are constant and shared by every stack.  Bytes that run an
+ *  action are never skipped since the actions do not see the data.
+ */
+static void emit_skip(machine_t *machine) {
+
+    machine_t *mac;
+    int i, num, total, num_skips = 0, *base, *index;
+
+    for(mac = machine, total = 0, num = 0; mac != NULL; mac = mac->next, num++)
+        total += mac->num_states;
+    base = calloc(num, sizeof(int));
+    index = calloc(total, sizeof(int));
+    if(NULL == base || NULL == index)
+        SERROR(FATAL_ERROR, "Cannot allocate the skip tables");
+
+    // the skipping states, numbered from 1
+    for(mac = machine, total = 0, num = 0; mac != NULL; mac = mac->next, num++) {
+        base[num] = total;
+        for(i = 0; i < mac->num_states; i++, total++)
+            if(loops_in_place(mac, i))
+                index[total] = ++num_skips;
+    }
+
+    fprintf(fp, "#define SM_SKIP_STOPS %d\n\n", SKIP_STOPS);
+    emit_section(skip_part);
+    fprintf(fp, "static const sm_skip_t sm_skip[%d] = {\n", (num_skips > 0)? num_skips: 1);
+    for(mac = machine, total = 0; mac != NULL; mac = mac->next)
+        for(i = 0; i < mac->num_states; i++, total++)
+            if(index[total] != 0)
+                emit_skip_state(mac, i);
+    if(num_skips == 0)
+        fprintf(fp, "    { 0, {0}, {0} },\n");
+    fprintf(fp, "};\n\n");
+    emit_int_array(index_type(total), "sm_state_base", base, num);
+    emit_int_array(index_type(num_skips + 1), "sm_skip_index", index, total);
+
+    fprintf(fp, "static size_t sm_skip_from(sm_stack_t *stack, const unsigned char *data, size_t i, size_t len) {\n\n");
+    fprintf(fp, "    const sm_skip_t *skip;\n");
+    fprintf(fp, "    sm_frame_t *f;\n");
+    fprintf(fp, "    size_t start = i;\n");
+    fprintf(fp, "    int n;\n\n");
+    if(opts->instrument || NULL != opts->trace) {
+        fprintf(fp, "#if %s\n", (!opts->instrument)? "defined(TRACE)":
+                (NULL == opts->trace)? "defined(INSTRUMENT)": "defined(INSTRUMENT) || defined(TRACE)");
+        fprintf(fp, "    return i;   // every byte is counted\n");
+        fprintf(fp, "#endif\n");
+    }
+    fprintf(fp, "    if(i >= len || stack->depth == 0)\n");
+    fprintf(fp, "        return i;\n");
+    fprintf(fp, "    f = &stack->frames[stack->depth - 1];\n");
+    fprintf(fp, "    if(0 == (n = sm_skip_index[sm_state_base[f->machine] + f->state]))\n");
+    fprintf(fp, "        return i;\n");
+    fprintf(fp, "    skip = &sm_skip[n - 1];\n\n");
+    emit_section(skip_search_part);
+    fprintf(fp, "    PRINT(\"machine = %%d: state = %%d: skipped %%d bytes\\n\", f->machine, f->state, (int)(i - start));\n");
+    fprintf(fp, "    (void)start;\n");
+    fprintf(fp, "    return i;\n");
+    fprintf(fp, "}\n\n");
+
+    free(base);
+    free(index);
+}
+
+/*
+ *  The push API runs the machines from the data that the caller hands it,
+ *  instead of having them read their own input.  sm_push_init() starts a
+ *  machine and sm_feed() runs it over a chunk of data, one classify() per
+ *  datum, until the chunk is used up or the machine finishes.  Because the
+ *  nested machines are frames on the stack rather than C calls, the whole
+ *  nest can stop at the end of a chunk and pick up again with the next one.
+ */
+static void emit_push(machine_t *machine, char *param, char *arg) {
+
+    machine_t *mac;
+
+    for(mac = machine; mac != NULL; mac = mac->next) {
+        if(NULL == mac->classify && NULL == mac->chars) {
+            fprintf(stderr, "EMIT ERROR: %s: The push API needs a classify function or character sets\n", mac->name);
+            exit(1);
+        }
+    }
+
+    if(opts->skip)
+        emit_skip(machine);
+
+    fprintf(fp, "static inline int sm_push_init(sm_stack_t *stack, int machine%s) {\n\n", param);
+    fprintf(fp, "    stack->depth = 0;\n");
+    fprintf(fp, "    stack->max_depth = 0;\n");
+    fprintf(fp, "    stack->result = SM_MORE;\n");
+    fprintf(fp, "    stack->used = 0;\n");
+    fprintf(fp, "    return sm_enter(stack, machine%s%s)? SM_MORE: SM_FAIL;\n", (*arg)? ", ": "", arg);
+    fprintf(fp, "}\n\n");
+
+    fprintf(fp, "static inline int sm_feed(sm_stack_t *stack%s, const unsigned char *data, size_t len) {\n\n", param);
+    fprintf(fp, "    size_t i;\n\n");
+    if(opts->skip) {
+        fprintf(fp, "    for(i = sm_skip_from(stack, data, 0, len); i < len && stack->depth > 0;\n");
+        fprintf(fp, "            i = sm_skip_from(stack, data, i + 1, len)) {\n");
+    }
+    else
+        fprintf(fp, "    for(i = 0; i < len && stack->depth > 0; i++) {\n");
+    emit_frame_step(machine, 1, arg);
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    stack->used = i;\n");
+    fprintf(fp, "    return stack->result;\n");
+    fprintf(fp, "}\n\n");
+}
+
+/*
+ *  The stack runner runs a machine and every machine that it names in one
+ *  loop, reading the input with the input functions as the machine functions
+ *  do.  The nested machines are frames on a stack that is SM_STACK_DEPTH
+ *  deep, so the depth does not depend on the C stack and max_depth shows how
+ *  deep it went.
+ */
+static void emit_run(machine_t *machine, char *param, char *arg) {
+
+    fprintf(fp, "static inline int sm_run(sm_stack_t *stack, int machine%s) {\n\n", param);
+    fprintf(fp, "    stack->depth = 0;\n");
+    fprintf(fp, "    stack->max_depth = 0;\n");
+    fprintf(fp, "    stack->result = SM_FAIL;\n");
+    fprintf(fp, "    stack->used = 0;\n");
+    fprintf(fp, "    if(!sm_enter(stack, machine%s%s))\n", (*arg)? ", ": "", arg);
+    fprintf(fp, "        return SM_FAIL;\n\n");
+    fprintf(fp, "    while(stack->depth > 0) {\n");
+    emit_frame_step(machine, 0, arg);
+    fprintf(fp, "        stack->used++;\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    return stack->result;\n");
+    fprintf(fp, "}\n\n");
+}
+
+/*
+ *  Emit the call of a machine from the batch runner of another one.  The
+ *  callee runs over the rest of the array, and if it runs out of input
+ *  before it finishes the caller stops as well.
+ */
+static void emit_batch_call(char *name, int index, char *arg) {
+
+    fprintf(fp, "            case %d: // %s\n", index, name);
+    fprintf(fp, "                if(%s_batch(%s%scodes + i, len - i, &n) < %s_END) {\n",
+            name, arg, (*arg)? ", ": "", name);
+    fprintf(fp, "                    *used = i + n;\n");
+    fprintf(fp, "                    return state;\n");
+    fprintf(fp, "                }\n");
+    fprintf(fp, "                i += n;\n");
+    fprintf(fp, "                break;\n");
+}
+
+/*
+ *  The batch runner of a machine takes an array of transitions that have
+ *  already been read, instead of calling the input function for every one.
+ *  It returns the state that the machine is in when it finishes or the array
+ *  runs out, and sets used to the number of transitions that it read.
+ */
+static void emit_batch_machine(machine_t *machine, machine_t *mac, char *param, char *arg) {
+
+    state_def_t *sd;
+    transition_t *tran;
+    char *called;
+    int i, calls = 0;
+
+    if(NULL == (called = calloc(num_actions, sizeof(char))))
+        SERROR(FATAL_ERROR, "Cannot allocate the call flags");
+    for(sd = mac->list; sd != NULL; sd = sd->next) {
+        for(tran = sd->list; tran != NULL; tran = tran->next) {
+            if(machine_number(machine, tran->func) >= 0 && !called[action_index(tran->func)]) {
+                called[action_index(tran->func)] = 1;
+                calls++;
+            }
+        }
+    }
+
+    fprintf(fp, "static inline int %s_batch(%sconst unsigned char *codes, size_t len, size_t *used) {\n\n", mac->name, param);
+    emit_state_enum(mac, "    ", "");
+    emit_table_aliases(mac);
+    if(mac->precode)
+        fprintf(fp, "    %s(%s);\n", mac->precode, arg);
+    fprintf(fp, "    int state = START;\n");
+    fprintf(fp, "    size_t i = 0%s;\n\n", (calls)? ", n": "");
+    fprintf(fp, "    while(i < len) {\n");
+    fprintf(fp, "        int trans = codes[i++];\n");
+    emit_hooks("        ", mac, "state");
+    if(is_comb(mac)) {
+        fprintf(fp, "        int slot = base[state] + trans_class[trans];\n");
+        fprintf(fp, "        int func = (check[slot] == state)? comb_action[slot]: default_action[state];\n");
+        fprintf(fp, "        int to = (check[slot] == state)? comb_next[slot]: default_next[state];\n");
+    }
+    else {
+        fprintf(fp, "        int func = action[state][trans_class[trans]];\n");
+        fprintf(fp, "        int to = next[state][trans_class[trans]];\n");
+    }
+    fprintf(fp, "        PRINT(\"state = %%d: trans = %%d => func: %%s state: %%d\\n\",\n");
+    fprintf(fp, "                state, trans, sm_action_names[func], to);\n");
+    fprintf(fp, "        state = to;\n");
+    if(calls) {
+        fprintf(fp, "        switch(func) {\n");
+        fprintf(fp, "            case 0:\n");
+        fprintf(fp, "                break;\n");
+        for(i = 0; i < num_actions; i++)
+            if(called[i])
+                emit_batch_call(action_list[i], i, arg);
+        fprintf(fp, "            default:\n");
+        fprintf(fp, "                (*actions[func])(%s);\n", arg);
+        fprintf(fp, "                break;\n");
+        fprintf(fp, "        }\n");
+    }
+    else {
+        fprintf(fp, "        if(func != 0)\n");
+        fprintf(fp, "            (*actions[func])(%s);\n", arg);
+    }
+    fprintf(fp, "        if(state == END || state == ERROR)\n");
+    fprintf(fp, "            break;\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    *used = i;\n");
+    if(mac->postcode) {
+        fprintf(fp, "    if(state == END || state == ERROR)\n");
+        fprintf(fp, "        %s(%s);\n", mac->postcode, arg);
+    }
+    fprintf(fp, "    return state;\n");
+    fprintf(fp, "}\n\n");
+
+    free(called);
+}
+
+/*
+ *  Split the byte table of a machine into nibble tables for a vector lookup.
+ *  Every transition other than the most common one is cut into rectangles of
+ *  high nibbles by low nibbles, and every rectangle gets a bit.  A byte has
+ *  the bit of its rectangle in both lo[low nibble] and hi[high nibble] and no
+ *  other bit in both, so ANDing them finds the one rectangle or nothing.  The
+ *  bit is turned back into the transition with two more lookups, one for each
+ *  nibble of the bit, which hold the transition XORed with the most common
+ *  one.  There are 8 bits to a pass.  Returns the number of passes, or 0 if
+ *  more than NIBBLE_PASSES would be needed.
+ */
+#define NIBBLE_PASSES 4
+
+static int nibble_tables(machine_t *mac, int tables[][4][16], int *common) {
+
+    int count[256] = { 0 }, mask[16], done[16];
+    int c, h, k, l, r = 0, bit, pass;
+
+    for(c = 0, *common = 0; c < 256; c++)
+        if(++count[mac->chars[c]] > count[*common])
+            *common = mac->chars[c];
+
+    memset(tables, 0, NIBBLE_PASSES * sizeof(tables[0]));
+    for(k = 0; k < mac->num_trans; k++) {
+        if(k == *common || count[k] == 0)
+            continue;
+        for(h = 0; h < 16; h++) {
+            for(l = 0, mask[h] = 0; l < 16; l++)
+                if(mac->chars[h * 16 + l] == k)
+                    mask[h] |= 1 << l;
+            done[h] = (mask[h] == 0);
+        }
+        for(h = 0; h < 16; h++) {
+            if(done[h])
+                continue;
+            if(r == NIBBLE_PASSES * 8)
+                return 0;
+            pass = r / 8;
+            bit = 1 << (r % 8);
+            r++;
+            for(l = 0; l < 16; l++)
+                if(mask[h] & (1 << l))
+                    tables[pass][0][l] |= bit;
+            for(l = h; l < 16; l++)
+                if(mask[l] == mask[h]) {
+                    tables[pass][1][l] |= bit;
+                    done[l] = 1;
+                }
+            if(bit < 16)
+                tables[pass][2][bit] = k ^ *common;
+            else
+                tables[pass][3][bit >> 4] = k ^ *common;
+        }
+    }
+    return (r + 7) / 8;
+}
+
+// the vector loops of the classify functions, for AVX2 and for SSSE3.
+static char *classify_part[] = {
+    "#if defined(__AVX2__)",
+    "    {",
+    "        const __m256i nibble = _mm256_set1_epi8(0x0F);",
+    "        int p;",
+    "",
+    "        for(; i + 32 <= len; i += 32) {",
+    "            __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));",
+    "            __m256i lo = _mm256_and_si256(v, nibble);",
+    "            __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);",
+    "            __m256i code = _mm256_set1_epi8((char)common);",
     "",
-    "#ifdef DEBUGGING",
-    "#  define PRINT(fmt, ...) fprintf(stderr, fmt, ## __VA_ARGS__)",
-    "#else",
-    "#  define PRINT(fmt, ...)",
-    "#endif",
+    "            for(p = 0; p < passes; p++) {",
+    "                __m256i bits = _mm256_and_si256(",
+    "                        _mm256_shuffle_epi8(NIBBLES256(p, 0), lo),",
+    "                        _mm256_shuffle_epi8(NIBBLES256(p, 1), hi));",
+    "                code = _mm256_xor_si256(code, _mm256_or_si256(",
+    "                        _mm256_shuffle_epi8(NIBBLES256(p, 2), _mm256_and_si256(bits, nibble)),",
+    "                        _mm256_shuffle_epi8(NIBBLES256(p, 3),",
+    "                            _mm256_and_si256(_mm256_srli_epi16(bits, 4), nibble))));",
+    "            }",
+    "            _mm256_storeu_si256((__m256i *)(codes + i), code);",
+    "        }",
+    "    }",
+    "#elif defined(__SSSE3__)",
+    "    {",
+    "        const __m128i nibble = _mm_set1_epi8(0x0F);",
+    "        int p;",
     "",
-    "// Function protos",
-    NULL,
+    "        for(; i + 16 <= len; i += 16) {",
+    "            __m128i v = _mm_loadu_si128((const __m128i *)(data + i));",
+    "            __m128i lo = _mm_and_si128(v, nibble);",
+    "            __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);",
+    "            __m128i code = _mm_set1_epi8((char)common);",
+    "",
+    "            for(p = 0; p < passes; p++) {",
+    "                __m128i bits = _mm_and_si128(",
+    "                        _mm_shuffle_epi8(NIBBLES128(p, 0), lo),",
+    "                        _mm_shuffle_epi8(NIBBLES128(p, 1), hi));",
+    "                code = _mm_xor_si128(code, _mm_or_si128(",
+    "                        _mm_shuffle_epi8(NIBBLES128(p, 2), _mm_and_si128(bits, nibble)),",
+    "                        _mm_shuffle_epi8(NIBBLES128(p, 3),",
+    "                            _mm_and_si128(_mm_srli_epi16(bits, 4), nibble))));",
+    "            }",
+    "            _mm_storeu_si128((__m128i *)(codes + i), code);",
+    "        }",
+    "    }",
+    "#endif",
+    NULL
 };
 
-// do not change this unless you know what you are doing.
-static char *runner[] = {
-    "\n",
-    "    int state = START;\n",
-    "    PRINT(\"\\nSM %s() ENTER\\n\", __func__);\n",
-    "    do{\n",
-    "        int trans = %s();\n",
-    "        PRINT(\"state = %d: trans = %d: char = \'%c\' (0x%02X) => func: %s state: %d\\n\",\n",
-    "                state, trans, (character == 0x0a)? ' ': character, character,\n",
-    "                func_to_strg(states[state][trans].func), states[state][trans].state);\n",
-    "        (*states[state][trans].func)();\n",
-    "        state = states[state][trans].state;\n",
-    "    }while(state != END && state != ERROR);\n",
-    "    PRINT(\"SM %s() RETURNING\\n\", __func__);\n",
-    "\n",
+static char *classify_head[] = {
+    "#if defined(__AVX2__)",
+    "#  include <immintrin.h>",
+    "#elif defined(__SSSE3__)",
+    "#  include <tmmintrin.h>",
+    "#endif",
+    "",
+    "#define NIBBLES128(p, t) _mm_loadu_si128((const __m128i *)nibbles[p][t])",
+    "#define NIBBLES256(p, t) _mm256_broadcastsi128_si256(NIBBLES128(p, t))",
+    "",
     NULL
 };
 
-static void emit_runner(char *name) {
+/*
+ *  The classify function of a machine with character sets turns a buffer of
+ *  bytes into the transitions that the batch runner takes, so that reading
+ *  the input is one tight loop and running the machine is another.  It is
+ *  emitted once for every byte table, and the machines that share the table
+ *  share the function.
+ */
+static void emit_classify(machine_t *machine) {
 
-    int i;
+    machine_t *mac, *owner;
+    int tables[NIBBLE_PASSES][4][16];
+    int passes, common, p, t, l;
 
-    for(i = 0; i < 4; i++)
-        fprintf(fp, "%s", runner[i]);
-    fprintf(fp, runner[i], name);
-    for(i++; runner[i] != NULL; i++)
-        fprintf(fp, "%s", runner[i]);
+    for(mac = machine; mac != NULL; mac = mac->next)
+        if(NULL != mac->chars)
+            break;
+    if(NULL == mac)
+        return;
 
+    emit_section(classify_head);
+    for(mac = machine; mac != NULL; mac = mac->next) {
+        if(NULL == mac->chars)
+            continue;
+        if((owner = chars_owner(mac)) != mac) {
+            fprintf(fp, "#define %s_classify %s_classify\n\n", mac->name, owner->name);
+            continue;
+        }
+
+        passes = nibble_tables(mac, tables, &common);
+        fprintf(fp, "static inline void %s_classify(const unsigned char *data, size_t len, unsigned char *codes) {\n\n",
+                mac->name);
+        fprintf(fp, "    size_t i = 0;\n");
+        if(passes > 0) {
+            printf("%s: classify in %d pass%s of nibble tables\n", mac->name, passes, (passes > 1)? "es": "");
+            fprintf(fp, "#if defined(__AVX2__) || defined(__SSSE3__)\n");
+            fprintf(fp, "    static const uint8_t nibbles[%d][4][16] = {\n", passes);
+            for(p = 0; p < passes; p++) {
+                fprintf(fp, "        {\n");
+                for(t = 0; t < 4; t++) {
+                    fprintf(fp, "            {");
+                    for(l = 0; l < 16; l++)
+                        fprintf(fp, "%d%s", tables[p][t][l], (l < 15)? ", ": "");
+                    fprintf(fp, "}%s\n", (t < 3)? ",": "");
+                }
+                fprintf(fp, "        }%s\n", (p < passes - 1)? ",": "");
+            }
+            fprintf(fp, "    };\n");
+            fprintf(fp, "    const int passes = %d, common = %d;\n", passes, common);
+            fprintf(fp, "#endif\n\n");
+            emit_section(classify_part);
+        }
+        else {
+            printf("%s: too many character ranges to classify with nibble tables\n", mac->name);
+            fprintf(fp, "\n");
+        }
+        fprintf(fp, "    for(; i < len; i++)\n");
+        fprintf(fp, "        codes[i] = %s_chars[data[i]];\n", mac->name);
+        fprintf(fp, "}\n\n");
+    }
 }
 
-static char *last_part[] = {
+static void emit_batch(machine_t *machine) {
+
+    machine_t *mac;
+    char param[310] = "";
+
+    if(NULL != opts->context)
+        snprintf(param, sizeof(param), "%s, ", ctx_param);
+
+    fprintf(fp, "#include <stddef.h>\n\n");
+    for(mac = machine; mac != NULL; mac = mac->next)
+        fprintf(fp, "static inline int %s_batch(%sconst unsigned char *codes, size_t len, size_t *used);\n",
+                mac->name, param);
+    fprintf(fp, "\n");
+    for(mac = machine; mac != NULL; mac = mac->next)
+        emit_batch_machine(machine, mac, param, ctx_arg);
+    emit_classify(machine);
+}
+
+// the chunks of the parallel runners, shared by every machine.
+static char *parallel_part[] = {
+    "#include <stddef.h>",
+    "#include <pthread.h>",
+    "",
+    "// the most threads that a parallel runner starts",
+    "#ifndef SM_MAX_THREADS",
+    "#  define SM_MAX_THREADS 64",
+    "#endif",
+    "// chunks are not made smaller than this, because a thread costs more",
+    "#ifndef SM_MIN_CHUNK",
+    "#  define SM_MIN_CHUNK 65536",
+    "#endif",
+    "",
+    "typedef struct {",
+    "    const unsigned char *data;",
+    "    size_t len;",
+    "    void *ctx;      // the actions of the chunk are called with this",
+    "    int *map;       // the state that the chunk ends in, for every state it can start in",
+    "    int start;      // the state that the chunk really starts in",
+    "    int end;",
+    "    size_t used;",
+    "} sm_chunk_t;",
+    "",
+    "// run every chunk but the first on a thread, or on this thread if there is none",
+    "static void sm_run_chunks(void *(*func)(void *), sm_chunk_t *chunks, int count) {",
+    "",
+    "    pthread_t threads[SM_MAX_THREADS];",
+    "    char started[SM_MAX_THREADS];",
+    "    int k;",
+    "",
+    "    for(k = 1; k < count; k++)",
+    "        if(!(started[k] = (0 == pthread_create(&threads[k], NULL, func, &chunks[k]))))",
+    "            (*func)(&chunks[k]);",
+    "    (*func)(&chunks[0]);",
+    "    for(k = 1; k < count; k++)",
+    "        if(started[k])",
+    "            pthread_join(threads[k], NULL);",
+    "}",
     "",
-    "// End of generated code",
     NULL
 };
 
-static inline void emit_section(char *text[]) {
-
-    int i;
+/*
+ *  A machine can be run in parallel if it reads bytes through character sets
+ *  and does not call other machines, because a chunk has to be run without
+ *  knowing what came before it.
+ */
+static int can_parallel(machine_t *machine, machine_t *mac) {
 
-    for(i = 0; text[i] != NULL; i++)
-        fprintf(fp, "%s\n", text[i]);
+    state_def_t *sd;
+    transition_t *tran;
+
+    if(NULL == mac->chars)
+        return 0;
+    for(sd = mac->list; sd != NULL; sd = sd->next)
+        for(tran = sd->list; tran != NULL; tran = tran->next)
+            if(machine_number(machine, tran->func) >= 0)
+                return 0;
+    return 1;
 }
 
-static state_def_t *select_state(machine_t *mac, char *name) {
-
-    state_def_t *state;
-    for(state = mac->list; state != NULL; state = state->next) {
-        if(!strcmp(state->name, name))
-            return state;
-    }
+/*
+ *  The first pass runs a chunk from every state at the same time, using a
+ *  table of the next state for every state and byte.  Start states that end
+ *  up in the same state stay together after that, so a chunk soon costs no
+ *  more than running it once.  END and ERROR stay where they are.
+ */
+static void emit_speculate(machine_t *mac) {
+
+    int num = mac->num_states + 2;
+
+    fprintf(fp, "static void *%s_speculate(void *arg) {\n\n", mac->name);
+    fprintf(fp, "    sm_chunk_t *c = arg;\n");
+    fprintf(fp, "    int live[%d], kept[%d], slot[%d], merged[%d], num = %d, n, j, k;\n", num, num, num, num, num);
+    fprintf(fp, "    size_t i = 0, stop;\n\n");
+    fprintf(fp, "    for(k = 0; k < %d; k++)\n", num);
+    fprintf(fp, "        live[k] = slot[k] = k;\n");
+    fprintf(fp, "    while(i < c->len && num > 1) {\n");
+    fprintf(fp, "        stop = (c->len - i > 64)? i + 64: c->len;\n");
+    fprintf(fp, "        for(; i < stop; i++)\n");
+    fprintf(fp, "            for(k = 0; k < num; k++)\n");
+    fprintf(fp, "                live[k] = %s_par_next[live[k] * 256 + c->data[i]];\n", mac->name);
+    fprintf(fp, "        // keep one of every state that is still live\n");
+    fprintf(fp, "        for(k = 0, n = 0; k < num; k++) {\n");
+    fprintf(fp, "            for(j = 0; j < n && kept[j] != live[k]; j++)\n");
+    fprintf(fp, "                ;\n");
+    fprintf(fp, "            merged[k] = j;\n");
+    fprintf(fp, "            if(j == n)\n");
+    fprintf(fp, "                kept[n++] = live[k];\n");
+    fprintf(fp, "        }\n");
+    fprintf(fp, "        for(k = 0; k < n; k++)\n");
+    fprintf(fp, "            live[k] = kept[k];\n");
+    fprintf(fp, "        for(k = 0; k < %d; k++)\n", num);
+    fprintf(fp, "            slot[k] = merged[slot[k]];\n");
+    fprintf(fp, "        num = n;\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    for(; i < c->len; i++)\n");
+    fprintf(fp, "        live[0] = %s_par_next[live[0] * 256 + c->data[i]];\n", mac->name);
+    fprintf(fp, "    for(k = 0; k < %d; k++)\n", num);
+    fprintf(fp, "        c->map[k] = live[slot[k]];\n");
+    fprintf(fp, "    return NULL;\n");
+    fprintf(fp, "}\n\n");
+}
 
-    PERROR(name, "Defined in the state list but does not have a definition");
-    return NULL;
+/*
+ *  The second pass runs every chunk again from the state that it really
+ *  starts in and calls the actions with the context of the chunk.
+ */
+static void emit_replay(machine_t *mac) {
+
+    fprintf(fp, "static void *%s_replay(void *arg) {\n\n", mac->name);
+    fprintf(fp, "    sm_chunk_t *c = arg;\n");
+    fprintf(fp, "    %s *ctx = c->ctx;\n", opts->context);
+    fprintf(fp, "    int state = c->start, func;\n");
+    fprintf(fp, "    size_t i = 0;\n\n");
+    fprintf(fp, "    while(i < c->len && state < %d) {\n", mac->num_states);
+    fprintf(fp, "        func = %s_par_action[state * 256 + c->data[i]];\n", mac->name);
+    fprintf(fp, "        state = %s_par_next[state * 256 + c->data[i++]];\n", mac->name);
+    fprintf(fp, "        if(func != 0)\n");
+    fprintf(fp, "            (*actions[func])(%s);\n", ctx_arg);
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    c->end = state;\n");
+    fprintf(fp, "    c->used = i;\n");
+    fprintf(fp, "    return NULL;\n");
+    fprintf(fp, "}\n\n");
 }
 
-static transition_t *select_trans(state_def_t *state, char *name) {
+static void emit_parallel_machine(machine_t *mac) {
 
-    transition_t *tran, *def;
     string_list_t *lst;
-
-    for(tran = state->list; tran!= NULL; tran = tran->next) {
-        for(lst = tran->list; lst != NULL; lst = lst->next)
-            if(!strcmp(lst->strg, name))
-                return tran;
-            else if(!strcmp(lst->strg, "DEFAULT"))
-                def = tran;
+    transition_t **row;
+    int *next, *action, num = mac->num_states + 2, i, b;
+    char name[300];
+
+    next = calloc((size_t)num * 256, sizeof(int));
+    action = calloc((size_t)num * 256, sizeof(int));
+    if(NULL == next || NULL == action)
+        SERROR(FATAL_ERROR, "Cannot allocate the parallel tables");
+
+    for(lst = mac->states, i = 0; lst != NULL; lst = lst->next, i++) {
+        row = select_row(mac, select_state(mac, lst->strg));
+        for(b = 0; b < 256; b++) {
+            next[i * 256 + b] = state_index(mac, row[mac->chars[b]]->state);
+            action[i * 256 + b] = action_of(mac, row[mac->chars[b]]);
+        }
+        free(row);
     }
-
-    if(def != NULL)
-        return def;
-    else {
-        PERROR(name, "Defined in the trans list but does not have a definition");
-        return NULL;
+    for(; i < num; i++)
+        for(b = 0; b < 256; b++)
+            next[i * 256 + b] = i;
+
+    snprintf(name, sizeof(name), "%s_par_next", mac->name);
+    emit_int_array(index_type(num), name, next, num * 256);
+    snprintf(name, sizeof(name), "%s_par_action", mac->name);
+    emit_int_array(index_type(num_actions), name, action, num * 256);
+    emit_speculate(mac);
+    emit_replay(mac);
+
+    // main.c only takes -j with -c, because the chunks run on threads at once
+    fprintf(fp, "static inline int %s_parallel(%s **ctxs, const unsigned char *data, size_t len, int threads, size_t *used) {\n\n",
+            mac->name, opts->context);
+    fprintf(fp, "    sm_chunk_t chunks[SM_MAX_THREADS];\n");
+    fprintf(fp, "    int maps[SM_MAX_THREADS][%d], state = 0, count, k;\n\n", num);
+    fprintf(fp, "    count = (threads < SM_MAX_THREADS)? threads: SM_MAX_THREADS;\n");
+    fprintf(fp, "    if((size_t)count > len / SM_MIN_CHUNK)\n");
+    fprintf(fp, "        count = (int)(len / SM_MIN_CHUNK);\n");
+    fprintf(fp, "    if(count < 1)\n");
+    fprintf(fp, "        count = 1;\n");
+    fprintf(fp, "    for(k = 0; k < count; k++) {\n");
+    fprintf(fp, "        chunks[k].data = data + len / count * k;\n");
+    fprintf(fp, "        chunks[k].len = (k == count - 1)? len - len / count * k: len / count;\n");
+    fprintf(fp, "        chunks[k].ctx = ctxs[k];\n");
+    fprintf(fp, "        chunks[k].map = maps[k];\n");
+    fprintf(fp, "    }\n");
+    if(mac->precode)
+        fprintf(fp, "    %s(ctxs[0]);\n\n", mac->precode);
+    fprintf(fp, "    // find the state that every chunk starts in, then run them for real\n");
+    fprintf(fp, "    if(count > 1)\n");
+    fprintf(fp, "        sm_run_chunks(%s_speculate, chunks, count);\n", mac->name);
+    fprintf(fp, "    for(k = 0; k < count; k++) {\n");
+    fprintf(fp, "        chunks[k].start = state;\n");
+    fprintf(fp, "        state = maps[k][state];\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    sm_run_chunks(%s_replay, chunks, count);\n\n", mac->name);
+    fprintf(fp, "    // the machine stops in the first chunk that gets to END or ERROR\n");
+    fprintf(fp, "    for(k = 0, *used = 0; k < count - 1 && chunks[k].end < %d; k++)\n", mac->num_states);
+    fprintf(fp, "        *used += chunks[k].len;\n");
+    fprintf(fp, "    *used += chunks[k].used;\n");
+    if(mac->postcode) {
+        fprintf(fp, "    if(chunks[k].end >= %d)\n", mac->num_states);
+        fprintf(fp, "        %s(ctxs[k]);\n", mac->postcode);
     }
+    fprintf(fp, "    return chunks[k].end;\n");
+    fprintf(fp, "}\n\n");
+
+    free(next);
+    free(action);
 }
 
-static void emit_trans(state_def_t *state, char *name) {
+/*
+ *  Emit M_parallel() for the machines that can be run in parallel.  The data
+ *  is cut into a chunk for every thread.  The first pass finds where every
+ *  chunk would end for every state it could start in, the states are chained
+ *  from START to find where every chunk really starts, and the second pass
+ *  runs the chunks again to call the actions.  The actions of a chunk get a
+ *  context of their own, so they can append to an output of their own that
+ *  the caller puts together afterwards.
+ */
+static void emit_parallel(machine_t *machine) {
+
+    machine_t *mac;
 
-    transition_t *tran = select_trans(state, name);
-    fprintf(fp, "{%s, %s}", tran->state, tran->func);
+    emit_section(parallel_part);
+    for(mac = machine; mac != NULL; mac = mac->next) {
+        if(can_parallel(machine, mac))
+            emit_parallel_machine(mac);
+        else
+            fprintf(fp, "// %s cannot be run in parallel, it does not have character sets or it calls a machine\n\n",
+                    mac->name);
+    }
 }
 
-static void emit_states(machine_t *mac) {
-
-    string_list_t *mlst;
-    string_list_t *tlst;
+// the vector helpers of the lockstep runners, shared by every machine.
+static char *lanes_part[] = {
+    "#include <stddef.h>",
+    "#include <stdint.h>",
+    "#if defined(__AVX512F__) || defined(__AVX2__)",
+    "#  include <immintrin.h>",
+    "#endif",
+    "",
+    "// the steps that the lanes take before their actions are called",
+    "#ifndef SM_LANE_BLOCK",
+    "#  define SM_LANE_BLOCK 64",
+    "#endif",
+    "",
+    "#if defined(__AVX512F__)",
+    "#  define SM_LANES 16",
+    "typedef __m512i sm_lanes_t;",
+    "#  define SM_LOAD(p) _mm512_loadu_si512((const void *)(p))",
+    "#  define SM_STORE(p, v) _mm512_storeu_si512((void *)(p), v)",
+    "#  define SM_SET1(x) _mm512_set1_epi32(x)",
+    "#  define SM_ADD(a, b) _mm512_add_epi32(a, b)",
+    "#  define SM_SUB(a, b) _mm512_sub_epi32(a, b)",
+    "#  define SM_AND(a, b) _mm512_and_si512(a, b)",
+    "#  define SM_SHL(a, n) _mm512_slli_epi32(a, n)",
+    "#  define SM_SHR(a, n) _mm512_srli_epi32(a, n)",
+    "#  define SM_GATHER(table, index) _mm512_i32gather_epi32(index, (const void *)(table), 2)",
+    "#  define SM_GT(a, b) ((unsigned)_mm512_cmpgt_epi32_mask(a, b))",
+    "#  define SM_EQ(a, b) ((unsigned)_mm512_cmpeq_epi32_mask(a, b))",
+    "#  define SM_BYTES(c) _mm512_setr_epi32(*c[0], *c[1], *c[2], *c[3], *c[4], *c[5], *c[6], *c[7], \\",
+    "        *c[8], *c[9], *c[10], *c[11], *c[12], *c[13], *c[14], *c[15])",
+    "#elif defined(__AVX2__)",
+    "#  define SM_LANES 8",
+    "typedef __m256i sm_lanes_t;",
+    "#  define SM_LOAD(p) _mm256_loadu_si256((const __m256i *)(p))",
+    "#  define SM_STORE(p, v) _mm256_storeu_si256((__m256i *)(p), v)",
+    "#  define SM_SET1(x) _mm256_set1_epi32(x)",
+    "#  define SM_ADD(a, b) _mm256_add_epi32(a, b)",
+    "#  define SM_SUB(a, b) _mm256_sub_epi32(a, b)",
+    "#  define SM_AND(a, b) _mm256_and_si256(a, b)",
+    "#  define SM_SHL(a, n) _mm256_slli_epi32(a, n)",
+    "#  define SM_SHR(a, n) _mm256_srli_epi32(a, n)",
+    "#  define SM_GATHER(table, index) _mm256_i32gather_epi32((const int *)(table), index, 2)",
+    "#  define SM_GT(a, b) ((unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(a, b))))",
+    "#  define SM_EQ(a, b) ((unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(a, b))))",
+    "#  define SM_BYTES(c) _mm256_setr_epi32(*c[0], *c[1], *c[2], *c[3], *c[4], *c[5], *c[6], *c[7])",
+    "#else",
+    "#  define SM_LANES 1",
+    "#endif",
+    "",
+    NULL
+};
 
+/*
+ *  The lockstep runner needs the next state and the action of a step in one
+ *  16 bit entry, so it can only be used for small machines.
+ */
+static int can_lanes(machine_t *machine, machine_t *mac) {
 
-    fprintf(fp, "    state_t states[%d][%d] = {\n", mac->num_states, mac->num_trans);
-    for(mlst = mac->states; mlst != NULL; mlst = mlst->next) {
-        state_def_t *state = select_state(mac, mlst->strg);
-        //emit_line(mac, lst->strg);
-        fprintf(fp, "        {");
-        for(tlst = mac->trans; tlst != NULL; tlst = tlst->next) {
-            emit_trans(state, tlst->strg);
-            if(tlst->next != NULL)
-                fprintf(fp, ", ");
-        }
-        fprintf(fp, "}");
-        if(mlst->next == NULL)
-            fprintf(fp, "\n");
-        else
-            fprintf(fp, ",\n");
+    return can_parallel(machine, mac) && mac->num_states + 2 <= 256 && num_actions <= 256;
+}
 
+/*
+ *  Emit the functions that finish the record in a lane, and that run a lane
+ *  on its own when there are not enough records left to fill the others.
+ */
+static void emit_lane_helpers(machine_t *mac) {
+
+    fprintf(fp, "static void %s_lane_finish(size_t rec, int state, int32_t left, %s **ctxs,\n",
+            mac->name, opts->context);
+    fprintf(fp, "        const size_t *lens, int *states, size_t *used) {\n\n");
+    fprintf(fp, "    states[rec] = state;\n");
+    fprintf(fp, "    used[rec] = lens[rec] - (size_t)left;\n");
+    if(mac->postcode) {
+        fprintf(fp, "    if(state >= %d)\n", mac->num_states);
+        fprintf(fp, "        %s(ctxs[rec]);\n", mac->postcode);
     }
-    fprintf(fp, "    };\n");
+    fprintf(fp, "}\n\n");
+
+    fprintf(fp, "static void %s_lane_scalar(const unsigned char *cur, size_t rec, int state, int32_t left,\n",
+            mac->name);
+    fprintf(fp, "        %s **ctxs,", opts->context);
+    fprintf(fp, " const size_t *lens, int *states, size_t *used) {\n\n");
+    fprintf(fp, "    int step;\n\n");
+    fprintf(fp, "    while(left > 0 && state < %d) {\n", mac->num_states);
+    fprintf(fp, "        step = %s_lane_step[state * 256 + *cur++];\n", mac->name);
+    fprintf(fp, "        left--;\n");
+    fprintf(fp, "        state = step & 0xFF;\n");
+    fprintf(fp, "        if(step >> 8)\n");
+    fprintf(fp, "            (*actions[step >> 8])(ctxs[rec]);\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    %s_lane_finish(rec, state, left, ctxs, lens, states, used);\n", mac->name);
+    fprintf(fp, "}\n\n");
 }
 
-static void emit_machine(machine_t *machine) {
+static void emit_lanes_machine(machine_t *mac) {
 
-    machine_t *mac;
     string_list_t *lst;
+    transition_t **row;
+    int *step, num = mac->num_states + 2, i, b;
+    char name[300];
+
+    // one more entry, because the gather reads 32 bits for every 16 bit entry
+    if(NULL == (step = calloc((size_t)num * 256 + 1, sizeof(int))))
+        SERROR(FATAL_ERROR, "Cannot allocate the lane table");
+    for(lst = mac->states, i = 0; lst != NULL; lst = lst->next, i++) {
+        row = select_row(mac, select_state(mac, lst->strg));
+        for(b = 0; b < 256; b++)
+            step[i * 256 + b] = state_index(mac, row[mac->chars[b]]->state)
+                    | action_of(mac, row[mac->chars[b]]) << 8;
+        free(row);
+    }
+    for(; i < num; i++)
+        for(b = 0; b < 256; b++)
+            step[i * 256 + b] = i;
+    snprintf(name, sizeof(name), "%s_lane_step", mac->name);
+    emit_int_array("uint16_t", name, step, num * 256 + 1);
+    free(step);
+
+    emit_lane_helpers(mac);
+
+    // main.c only takes -l with -c, because the records are run at the same time
+    fprintf(fp, "static inline void %s_lanes(%s **ctxs, const unsigned char *const *records, const size_t *lens,\n",
+            mac->name, opts->context);
+    fprintf(fp, "        size_t count, int *states, size_t *used) {\n\n");
+    fprintf(fp, "    const unsigned char *cur[SM_LANES];\n");
+    fprintf(fp, "    size_t rec[SM_LANES];\n");
+    fprintf(fp, "    int32_t state[SM_LANES] = {0}, left[SM_LANES] = {0};\n");
+    fprintf(fp, "    size_t next = 0;\n");
+    fprintf(fp, "    int busy = 0;\n\n");
+
+    fprintf(fp, "    // start the next record in a lane, and finish the empty ones on the way\n");
+    fprintf(fp, "#define START_LANE(l) \\\n");
+    fprintf(fp, "    for(busy = 0; !busy && next < count; next++) { \\\n");
+    fprintf(fp, "        rec[l] = next; \\\n");
+    fprintf(fp, "        cur[l] = records[next]; \\\n");
+    fprintf(fp, "        state[l] = 0; \\\n");
+    fprintf(fp, "        left[l] = (int32_t)lens[next]; \\\n");
+    if(mac->precode)
+        fprintf(fp, "        %s(ctxs[next]); \\\n", mac->precode);
+    fprintf(fp, "        if(left[l] == 0) \\\n");
+    fprintf(fp, "            %s_lane_finish(next, 0, 0, ctxs, lens, states, used); \\\n", mac->name);
+    fprintf(fp, "        else \\\n");
+    fprintf(fp, "            busy = 1; \\\n");
+    fprintf(fp, "    }\n\n");
+
+    fprintf(fp, "#if SM_LANES > 1\n");
+    fprintf(fp, "    int32_t acts[SM_LANE_BLOCK][SM_LANES];\n");
+    fprintf(fp, "    unsigned masks[SM_LANE_BLOCK], special = 0, m;\n");
+    fprintf(fp, "    int l, k, j, full = 1;\n\n");
+    fprintf(fp, "    for(l = 0; l < SM_LANES && full; l++) {\n");
+    fprintf(fp, "        START_LANE(l);\n");
+    fprintf(fp, "        full = busy;\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    if(full) {\n");
+    fprintf(fp, "        const sm_lanes_t low = SM_SET1(0xFF), zero = SM_SET1(0), one = SM_SET1(1);\n");
+    fprintf(fp, "        const sm_lanes_t last = SM_SET1(%d);\n", mac->num_states - 1);
+    fprintf(fp, "        sm_lanes_t vstate = SM_LOAD(state), vleft = SM_LOAD(left), e, act;\n\n");
+    fprintf(fp, "        for(;;) {\n");
+    fprintf(fp, "            // step every lane, and keep the actions for later\n");
+    fprintf(fp, "            for(k = 0; k < SM_LANE_BLOCK && !special; k++) {\n");
+    fprintf(fp, "                e = SM_GATHER(%s_lane_step, SM_ADD(SM_SHL(vstate, 8), SM_BYTES(cur)));\n", mac->name);
+    fprintf(fp, "                for(l = 0; l < SM_LANES; l++)\n");
+    fprintf(fp, "                    cur[l]++;\n");
+    fprintf(fp, "                vstate = SM_AND(e, low);\n");
+    fprintf(fp, "                act = SM_AND(SM_SHR(e, 8), low);\n");
+    fprintf(fp, "                vleft = SM_SUB(vleft, one);\n");
+    fprintf(fp, "                SM_STORE(acts[k], act);\n");
+    fprintf(fp, "                masks[k] = SM_GT(act, zero);\n");
+    fprintf(fp, "                special = SM_GT(vstate, last) | SM_EQ(vleft, zero);\n");
+    fprintf(fp, "            }\n\n");
+    fprintf(fp, "            // the actions of a lane are called in order, the lanes do not share a context\n");
+    fprintf(fp, "            for(j = 0; j < k; j++)\n");
+    fprintf(fp, "                for(m = masks[j], l = 0; m != 0; m >>= 1, l++)\n");
+    fprintf(fp, "                    if(m & 1)\n");
+    fprintf(fp, "                        (*actions[acts[j][l]])(ctxs[rec[l]]);\n");
+    fprintf(fp, "            if(!special)\n");
+    fprintf(fp, "                continue;\n\n");
+    fprintf(fp, "            // finish the records that got to the end, and start the next ones\n");
+    fprintf(fp, "            SM_STORE(state, vstate);\n");
+    fprintf(fp, "            SM_STORE(left, vleft);\n");
+    fprintf(fp, "            for(l = 0; l < SM_LANES; l++) {\n");
+    fprintf(fp, "                if(!(special & (1u << l)))\n");
+    fprintf(fp, "                    continue;\n");
+    fprintf(fp, "                %s_lane_finish(rec[l], state[l], left[l], ctxs, lens, states, used);\n", mac->name);
+    fprintf(fp, "                START_LANE(l);\n");
+    fprintf(fp, "                if(!busy) {\n");
+    fprintf(fp, "                    full = 0;\n");
+    fprintf(fp, "                    left[l] = 0;\n");
+    fprintf(fp, "                }\n");
+    fprintf(fp, "            }\n");
+    fprintf(fp, "            if(!full)\n");
+    fprintf(fp, "                break;\n");
+    fprintf(fp, "            special = 0;\n");
+    fprintf(fp, "            vstate = SM_LOAD(state);\n");
+    fprintf(fp, "            vleft = SM_LOAD(left);\n");
+    fprintf(fp, "        }\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    // the records that were started and are not finished yet\n");
+    fprintf(fp, "    for(l = 0; l < SM_LANES; l++)\n");
+    fprintf(fp, "        if(left[l] > 0)\n");
+    fprintf(fp, "            %s_lane_scalar(cur[l], rec[l], state[l], left[l], ctxs, lens, states, used);\n", mac->name);
+    fprintf(fp, "#endif\n\n");
+
+    fprintf(fp, "    for(;;) {\n");
+    fprintf(fp, "        START_LANE(0);\n");
+    fprintf(fp, "        if(!busy)\n");
+    fprintf(fp, "            break;\n");
+    fprintf(fp, "        %s_lane_scalar(cur[0], rec[0], state[0], left[0], ctxs, lens, states, used);\n", mac->name);
+    fprintf(fp, "    }\n");
+    fprintf(fp, "#undef START_LANE\n");
+    fprintf(fp, "}\n\n");
+}
 
-    // emit the machine protos
-    for(mac = machine; mac != NULL; mac = mac->next)
-        fprintf(fp, "static int %s(void);\n", mac->name);
-    fprintf(fp, "\n\n");
-
-    // emit all of the machine definitions
-    for(mac = machine; mac != NULL; mac = mac->next) {
-        fprintf(fp, "static int %s(void) {\n\n", mac->name);
-
-        fprintf(fp, "    enum { ");
-        for(lst = mac->states; lst != NULL; lst = lst->next)
-            fprintf(fp, "%s, ", lst->strg);
-        fprintf(fp, "END, ERROR, };\n\n");
 /*
-fprintf(fp, "// ");
-for(lst = mac->trans; lst != NULL; lst = lst->next)
-    fprintf(fp, "%s, ", lst->strg);
-fprintf(fp, "\n\n");
-*/
-        emit_states(mac);
+ *  Emit M_lanes() for the small machines that read bytes and do not call
+ *  other machines.  It runs a record in every lane of a vector and steps all
+ *  of them with one gather from a table of the next state and the action for
+ *  every state and byte.  The actions go to a block of steps for every lane
+ *  and are called after the block, and a lane starts the next record as soon
+ *  as the one in it is finished.
+ */
+static void emit_lanes(machine_t *machine) {
 
-        if(mac->precode)
-            fprintf(fp, "    %s();\n", mac->precode);
-        emit_runner(mac->input);
-        //fprintf(fp, "    RUN_STATE(%s, %s_states);\n", mac->input, mac->name);
-        if(mac->postcode)
-            fprintf(fp, "    %s();\n", mac->postcode);
-        fprintf(fp, "    return (state == END)? 0: -1;\n");
-        fprintf(fp, "}\n\n\n");
+    machine_t *mac;
+
+    emit_section(lanes_part);
+    for(mac = machine; mac != NULL; mac = mac->next) {
+        if(can_lanes(machine, mac))
+            emit_lanes_machine(mac);
+        else
+            fprintf(fp, "// %s cannot be run in lanes, it is too big, it does not have character sets or it calls a machine\n\n",
+                    mac->name);
     }
 }
 
@@ -194,8 +2797,6 @@ static void emit_amble(char *amb) {
     }
 }
 
-static string_list_t *func_list = NULL;
-
 static void add_to_string_list(string_list_t **slist, char *str) {
 
     string_list_t *elem, *nelem;
@@ -216,6 +2817,19 @@ static void add_to_string_list(string_list_t **slist, char *str) {
     *slist = nelem;
 }
 
+/*
+ *  Return non-zero if the inline block has nothing but white space in it.
+ */
+static int empty_inline(char *func) {
+
+    size_t i, len = strlen(func);
+
+    for(i = 2; i + 2 < len; i++)
+        if(!isspace((unsigned char)func[i]))
+            return 0;
+    return 1;
+}
+
 static void emit_inline_func(char **func) {
 
     static int func_no = 0;
@@ -223,14 +2837,22 @@ static void emit_inline_func(char **func) {
 
     snprintf(buffer, sizeof(buffer), "_%04X", func_no);
     func_no++;
-    fprintf(fp, "static int %s(void) {\n", buffer);
+    if(opts->backend == BACKEND_CPP) {
+        fprintf(fp, "template <typename Handler>\n");
+        fprintf(fp, "inline int %s([[maybe_unused]] Handler &handler) {\n", buffer);
+    }
+    else
+        fprintf(fp, "static int %s(%s) {\n", buffer, ctx_param);
     emit_amble(*func);
     fprintf(fp, "\n    return 0;\n}\n\n");
 
+    if(empty_inline(*func))
+        add_to_string_list(&nop_list, buffer);
+    add_to_string_list(&inline_list, buffer);
+
     free(*func);
     if(NULL == (*func = strdup(buffer)))
         SERROR(FATAL_ERROR, "Cannot allocate function from inline code");
-    add_to_string_list(&func_list, *func);
 }
 
 static void emit_inline_code(definition_t *def) {
@@ -246,74 +2868,440 @@ static void emit_inline_code(definition_t *def) {
                 if(!strncmp(trans->func, "{{", 2)) {
                     emit_inline_func(&trans->func);
                 }
-                else {
-                    add_to_string_list(&func_list, trans->func);
-                }
             }
         }
 
-        if(NULL != mac->input) {
-            if(!strncmp(mac->input, "{{", 2)) {
-                emit_inline_func(&mac->input);
-            }
-            else {
-                add_to_string_list(&func_list, mac->input);
-            }
+        if(NULL != mac->input && !strncmp(mac->input, "{{", 2)) {
+            emit_inline_func(&mac->input);
         }
 
-        if(NULL != mac->precode) {
-            if(!strncmp(mac->precode, "{{", 2)) {
-                emit_inline_func(&mac->precode);
-            }
-            else {
-                add_to_string_list(&func_list, mac->precode);
-            }
+        if(NULL != mac->precode && !strncmp(mac->precode, "{{", 2)) {
+            emit_inline_func(&mac->precode);
         }
 
-        if(NULL != mac->postcode) {
-            if(!strncmp(mac->postcode, "{{", 2)) {
-                emit_inline_func(&mac->postcode);
-            }
-            else {
-                add_to_string_list(&func_list, mac->postcode);
-            }
+        if(NULL != mac->postcode && !strncmp(mac->postcode, "{{", 2)) {
+            emit_inline_func(&mac->postcode);
         }
     }
     fprintf(fp, "// end of inline code definitions\n");
 }
 
-static void emit_func_list(void) {
+/*
+ *  Emit the names of everything in the machines as tables that are indexed
+ *  by the same numbers that the runners use, so that tracers and monitors can
+ *  look a name up without searching.  Machines are numbered in the order that
+ *  they are defined.
+ */
+static void emit_reflection(machine_t *machine) {
+
+    machine_t *mac;
+    string_list_t *lst;
+    transition_t **row;
+    int i, num;
+
+    fprintf(fp, "// the names of the machines, for tracers and monitors\n");
+    fprintf(fp, "enum { ");
+    for(mac = machine, num = 0; mac != NULL; mac = mac->next, num++)
+        fprintf(fp, "SM_%s, ", mac->name);
+    fprintf(fp, "};\n\n");
+
+    // action 0 is every action that does nothing
+    fprintf(fp, "static const char *const sm_action_names[%d] = {\n", num_actions);
+    for(i = 0; i < num_actions; i++)
+        fprintf(fp, "    \"%s\",\n", (i == 0)? "nop": action_list[i]);
+    fprintf(fp, "};\n\n");
+
+    for(mac = machine; mac != NULL; mac = mac->next) {
+        fprintf(fp, "static const char *const %s_state_names[%d] = {", mac->name, mac->num_states + 2);
+        for(lst = mac->states; lst != NULL; lst = lst->next)
+            fprintf(fp, " \"%s\",", lst->strg);
+        fprintf(fp, " \"END\", \"ERROR\", };\n");
+        fprintf(fp, "static const char *const %s_trans_names[%d] = {", mac->name, mac->num_trans);
+        for(lst = mac->trans; lst != NULL; lst = lst->next)
+            fprintf(fp, " \"%s\",", lst->strg);
+        fprintf(fp, " };\n");
+        fprintf(fp, "static const uint16_t %s_actions[%d][%d] = {\n", mac->name, mac->num_states, mac->num_trans);
+        for(lst = mac->states; lst != NULL; lst = lst->next) {
+            row = select_row(mac, select_state(mac, lst->strg));
+            fprintf(fp, "    {");
+            for(i = 0; i < mac->num_trans; i++)
+                fprintf(fp, "%s%d", (i)? ", ": "", action_of(mac, row[i]));
+            fprintf(fp, "},\n");
+            free(row);
+        }
+        fprintf(fp, "};\n\n");
+    }
+
+    emit_section(reflection_part);
+    fprintf(fp, "static const sm_machine_info_t sm_machines[%d] = {\n", num);
+    for(mac = machine; mac != NULL; mac = mac->next)
+        fprintf(fp, "    {\"%s\", %d, %d, %s_state_names, %s_trans_names, &%s_actions[0][0]},\n",
+                mac->name, mac->num_states, mac->num_trans, mac->name, mac->name, mac->name);
+    fprintf(fp, "};\n\n");
+    emit_section(reflection_api_part);
+}
+
+// the binary table file is built in memory and then written all at once.
+static unsigned char *bin_data = NULL;
+static size_t bin_size = 0;
+static char *bin_strings = NULL;
+static size_t strings_size = 0;
+
+/*
+ *  Add the data to the binary file on an 8 byte boundary and return where it
+ *  starts.  The data can be NULL to make room for it.
+ */
+static uint32_t bin_add(const void *data, size_t size) {
+
+    size_t start = (bin_size + 7) & ~(size_t)7;
+
+    if(NULL == (bin_data = realloc(bin_data, start + size)))
+        SERROR(FATAL_ERROR, "Cannot allocate the binary tables");
+    memset(&bin_data[bin_size], 0, start + size - bin_size);
+    if(NULL != data)
+        memcpy(&bin_data[start], data, size);
+    bin_size = start + size;
+    return (uint32_t)start;
+}
+
+/*
+ *  Return the offset of the name in the strings, adding it if it is new.
+ */
+static uint32_t bin_name(const char *name) {
+
+    size_t i, len;
+
+    if(NULL == name)
+        return SM_FILE_NONE;
+    len = strlen(name) + 1;
+    for(i = 0; i < strings_size; i += strlen(&bin_strings[i]) + 1)
+        if(!strcmp(&bin_strings[i], name))
+            return (uint32_t)i;
+
+    if(NULL == (bin_strings = realloc(bin_strings, strings_size + len)))
+        SERROR(FATAL_ERROR, "Cannot allocate the binary names");
+    memcpy(&bin_strings[strings_size], name, len);
+    strings_size += len;
+    return (uint32_t)i;
+}
+
+/*
+ *  Inline code cannot be run from a binary file.  Inline code that is empty
+ *  does nothing, so it is allowed.  Returns the function, or NULL if there
+ *  is nothing to call.
+ */
+static char *bin_func(machine_t *mac, char *func, int optional) {
+
+    if(NULL == func || strncmp(func, "{{", 2))
+        return func;
+    if(optional && empty_inline(func))
+        return NULL;
+    fprintf(stderr, "EMIT ERROR: %s: Inline code cannot be written to a binary table\n", mac->name);
+    exit(1);
+}
+
+static void bin_machine(machine_t *mac, sm_file_machine_t *rec) {
+
+    string_list_t *mlst;
+    transition_t **row;
+    uint16_t *next, *action;
+    int i, j;
+
+    next = calloc((size_t)mac->num_states * mac->num_trans, sizeof(uint16_t));
+    action = calloc((size_t)mac->num_states * mac->num_trans, sizeof(uint16_t));
+    if(NULL == next || NULL == action)
+        SERROR(FATAL_ERROR, "Cannot allocate the binary tables");
+
+    for(mlst = mac->states, i = 0; mlst != NULL; mlst = mlst->next, i++) {
+        row = select_row(mac, select_state(mac, mlst->strg));
+        for(j = 0; j < mac->num_trans; j++) {
+            next[i * mac->num_trans + j] = (uint16_t)state_index(mac, row[j]->state);
+            action[i * mac->num_trans + j] = (uint16_t)action_of(mac, row[j]);
+        }
+        free(row);
+    }
+
+    rec->name = bin_name(mac->name);
+    rec->input = bin_name(bin_func(mac, mac->input, 0));
+    rec->precode = bin_name(bin_func(mac, mac->precode, 1));
+    rec->postcode = bin_name(bin_func(mac, mac->postcode, 1));
+    rec->num_states = mac->num_states;
+    rec->num_trans = mac->num_trans;
+    rec->chars = (NULL == mac->chars)? SM_FILE_NONE: bin_add(mac->chars, 256);
+    rec->next = bin_add(next, (size_t)mac->num_states * mac->num_trans * sizeof(uint16_t));
+    rec->action = bin_add(action, (size_t)mac->num_states * mac->num_trans * sizeof(uint16_t));
+
+    free(next);
+    free(action);
+}
+
+/*
+ *  Write the tables of every machine to a file that the runtime in smtable.c
+ *  maps and runs, instead of C source.  The actions are written by name and
+ *  are bound to functions when the file is opened.
+ */
+static void emit_binary(definition_t *def, char *name) {
+
+    machine_t *mac;
+    state_def_t *sd;
+    transition_t *trans;
+    sm_file_header_t header;
+    sm_file_machine_t *machines;
+    sm_file_action_t *actions;
+    int i, num;
+
+    for(mac = def->machine_list, num = 0; mac != NULL; mac = mac->next, num++)
+        for(sd = mac->list; sd != NULL; sd = sd->next)
+            for(trans = sd->list; trans != NULL; trans = trans->next)
+                if(NULL == bin_func(mac, trans->func, 1))
+                    add_to_string_list(&nop_list, trans->func);
+    collect_actions(def);
+
+    machines = calloc(num, sizeof(sm_file_machine_t));
+    actions = calloc(num_actions, sizeof(sm_file_action_t));
+    if(NULL == machines || NULL == actions)
+        SERROR(FATAL_ERROR, "Cannot allocate the binary tables");
+
+    bin_add(NULL, sizeof(header));
+    for(mac = def->machine_list, i = 0; mac != NULL; mac = mac->next, i++)
+        bin_machine(mac, &machines[i]);
+
+    // action 0 is every action that does nothing
+    for(i = 0; i < num_actions; i++) {
+        actions[i].name = bin_name((i == 0)? "nop": action_list[i]);
+        actions[i].machine = (i == 0 || machine_number(def->machine_list, action_list[i]) < 0)?
+                SM_FILE_NONE: (uint32_t)machine_number(def->machine_list, action_list[i]);
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = SM_FILE_MAGIC;
+    header.version = SM_FILE_VERSION;
+    header.byte_order = SM_FILE_BYTE_ORDER;
+    header.num_machines = num;
+    header.num_actions = num_actions;
+    header.machines = bin_add(machines, num * sizeof(sm_file_machine_t));
+    header.actions = bin_add(actions, num_actions * sizeof(sm_file_action_t));
+    header.strings_size = (uint32_t)strings_size;
+    header.strings = bin_add(bin_strings, strings_size);
+    header.size = (uint32_t)bin_size;
+    memcpy(bin_data, &header, sizeof(header));
+
+    if(NULL == (fp = fopen(name, "wb")))
+        SERROR(FILE_ERROR, "Cannot open the output file \"%s\": ", name);
+    if(fwrite(bin_data, 1, bin_size, fp) != bin_size) {
+        fprintf(stderr, "EMIT ERROR: Cannot write the binary tables: ");
+        perror("");
+        exit(1);
+    }
+    fclose(fp);
+
+    free(machines);
+    free(actions);
+    free(bin_data);
+    free(bin_strings);
+}
+
+/*
+ *  Emit a call to a function from a C++ machine.  Machines are run with the
+ *  same handler, inline blocks are given the handler and everything else is
+ *  a member function of the handler.
+ */
+static void emit_cpp_call(char *indent, char *func, char *end) {
+
+    string_list_t *lst;
+
+    if(machine_number(machine_list, func) >= 0) {
+        fprintf(fp, "%s%s<Handler>(handler_).run()%s", indent, func, end);
+        return;
+    }
+    for(lst = inline_list; lst != NULL; lst = lst->next)
+        if(!strcmp(lst->strg, func)) {
+            fprintf(fp, "%s%s(handler_)%s", indent, func, end);
+            return;
+        }
+    fprintf(fp, "%shandler_.%s()%s", indent, func, end);
+}
+
+static void emit_cpp_table(machine_t *mac, char *name, char *type, int *cells) {
+
+    int i, j;
+
+    fprintf(fp, "    static constexpr std::%s %s[%d][%d] = {\n", type, name, mac->num_states, mac->num_trans);
+    for(i = 0; i < mac->num_states; i++) {
+        fprintf(fp, "        {");
+        for(j = 0; j < mac->num_trans; j++)
+            fprintf(fp, "%s%d", (j)? ", ": "", cells[i * mac->num_trans + j]);
+        fprintf(fp, "},\n");
+    }
+    fprintf(fp, "    };\n");
+}
+
+/*
+ *  Every machine is a class template on the type of the handler, with its
+ *  tables as constexpr members.  The actions are numbered in the machine and
+ *  called from a switch, so the compiler sees every call and can inline the
+ *  member functions of the handler.
+ */
+static void emit_cpp_machine(machine_t *mac) {
 
-    string_list_t *lst = func_list;
+    string_list_t *lst;
+    transition_t **row;
+    char **funcs, *type;
+    int *next, *action, num_funcs = 0, i, j, k;
+
+    next = calloc((size_t)mac->num_states * mac->num_trans, sizeof(int));
+    action = calloc((size_t)mac->num_states * mac->num_trans, sizeof(int));
+    funcs = calloc((size_t)mac->num_states * mac->num_trans + 1, sizeof(char *));
+    if(NULL == next || NULL == action || NULL == funcs)
+        SERROR(FATAL_ERROR, "Cannot allocate the C++ tables");
+
+    // action 0 does nothing and the others are numbered as they are found
+    for(lst = mac->states, i = 0; lst != NULL; lst = lst->next, i++) {
+        row = select_row(mac, select_state(mac, lst->strg));
+        for(j = 0; j < mac->num_trans; j++) {
+            next[i * mac->num_trans + j] = state_index(mac, row[j]->state);
+            if(is_nop(mac, row[j]->func))
+                continue;
+            for(k = 1; k <= num_funcs && strcmp(funcs[k], row[j]->func); k++)
+                ;
+            if(k > num_funcs)
+                funcs[++num_funcs] = row[j]->func;
+            action[i * mac->num_trans + j] = k;
+        }
+        free(row);
+    }
 
-    fprintf(fp, "#define func_to_strg(func) ( \\\n");
-    for(lst = func_list; lst != NULL; lst = lst->next) {
-        fprintf(fp, "                   (func == %s)? \"%s\": \\\n", lst->strg, lst->strg);
+    fprintf(fp, "template <typename Handler>\n");
+    fprintf(fp, "class %s {\n", mac->name);
+    fprintf(fp, "public:\n");
+    fprintf(fp, "    enum state_id : int {");
+    for(lst = mac->states; lst != NULL; lst = lst->next)
+        fprintf(fp, " %s,", lst->strg);
+    fprintf(fp, " END, ERROR };\n\n");
+    fprintf(fp, "    explicit %s(Handler &handler) : handler_(handler) {}\n\n", mac->name);
+    fprintf(fp, "    // returns 0 when the machine gets to END and -1 for ERROR\n");
+    fprintf(fp, "    int run();\n\n");
+    fprintf(fp, "private:\n");
+    if(NULL != mac->chars) {
+        fprintf(fp, "    static constexpr std::uint8_t chars[256] = {");
+        for(i = 0; i < 256; i++)
+            fprintf(fp, "%s%d,", (i % 16)? " ": "\n        ", mac->chars[i]);
+        fprintf(fp, "\n    };\n");
+    }
+    type = index_type(mac->num_states + 2);
+    emit_cpp_table(mac, "next", type, next);
+    type = index_type(num_funcs + 1);
+    emit_cpp_table(mac, "action", type, action);
+    fprintf(fp, "\n    Handler &handler_;\n");
+    fprintf(fp, "};\n\n");
+
+    fprintf(fp, "template <typename Handler>\n");
+    fprintf(fp, "int %s<Handler>::run() {\n\n", mac->name);
+    fprintf(fp, "    int state = START;\n");
+    if(mac->precode && !is_nop(mac, mac->precode))
+        emit_cpp_call("    ", mac->precode, ";\n");
+    fprintf(fp, "    do{\n");
+    fprintf(fp, "        int trans = %s", (NULL != mac->chars)? "chars[": "");
+    emit_cpp_call("", mac->input, (NULL != mac->chars)? "];\n": ";\n");
+    fprintf(fp, "        switch(action[state][trans]) {\n");
+    for(k = 1; k <= num_funcs; k++) {
+        fprintf(fp, "            case %d:\n", k);
+        emit_cpp_call("                ", funcs[k], ";\n");
+        fprintf(fp, "                break;\n");
     }
-    fprintf(fp, " \"UNKNOWN\")\n\n");
+    fprintf(fp, "            default:\n");
+    fprintf(fp, "                break;\n");
+    fprintf(fp, "        }\n");
+    fprintf(fp, "        state = next[state][trans];\n");
+    fprintf(fp, "    }while(state != END && state != ERROR);\n");
+    if(mac->postcode && !is_nop(mac, mac->postcode))
+        emit_cpp_call("    ", mac->postcode, ";\n");
+    fprintf(fp, "    return (state == END)? 0: -1;\n");
+    fprintf(fp, "}\n\n");
+
+    free(next);
+    free(action);
+    free(funcs);
+}
+
+/*
+ *  The C++ backend writes a header with the preamble, the inline blocks and
+ *  a class template for every machine, and then the postamble.
+ */
+static void emit_cpp(definition_t *def) {
+
+    machine_t *mac;
+
+    fprintf(fp, "// Generated by stategen.  Needs C++17.\n");
+    fprintf(fp, "#pragma once\n\n");
+    fprintf(fp, "#include <cstdint>\n\n");
+    emit_amble(def->preamble);
+
+    emit_inline_code(def);
+    for(mac = def->machine_list; mac != NULL; mac = mac->next)
+        fprintf(fp, "template <typename Handler> class %s;\n", mac->name);
+    fprintf(fp, "\n");
+    for(mac = def->machine_list; mac != NULL; mac = mac->next)
+        emit_cpp_machine(mac);
 
+    emit_section(last_part);
+    emit_amble(def->postamble);
 }
 
 /*
  *  Top level UI
  */
-void emit_definition(definition_t *def, char *name) {
+void emit_definition(definition_t *def, char *name, emit_options_t *options) {
 
+    char param[310] = "";
+
+    opts = options;
+    machine_list = def->machine_list;
+    if(opts->backend == BACKEND_BINARY) {
+        emit_binary(def, name);
+        return;
+    }
+    if(NULL != opts->context) {
+        snprintf(ctx_param, sizeof(ctx_param), "%s *ctx", opts->context);
+        ctx_arg = "ctx";
+        print_char = "#define PRINT_CHAR_FMT \"\"\n#define PRINT_CHAR_ARGS";
+    }
     if(NULL == (fp = fopen(name, "w")))
         SERROR(FILE_ERROR, "Cannot open the output file \"%s\": ", name);
+    if(opts->backend == BACKEND_CPP) {
+        emit_cpp(def);
+        return;
+    }
 
     emit_amble(def->preamble);
 
     emit_section(first_part);
     emit_inline_code(def);
-    //emit_section(runner1);
-    emit_func_list();
-    //emit_section(runner2);
+    collect_actions(def);
+    emit_reflection(def->machine_list);
 
     emit_machine(def->machine_list);
+    if(opts->batch)
+        emit_batch(def->machine_list);
+    if(opts->parallel)
+        emit_parallel(def->machine_list);
+    if(opts->lanes)
+        emit_lanes(def->machine_list);
+    if(opts->push || opts->run) {
+        if(NULL != opts->context)
+            snprintf(param, sizeof(param), ", %s", ctx_param);
+        emit_frames(def->machine_list, param, ctx_arg);
+        if(opts->push)
+            emit_push(def->machine_list, param, ctx_arg);
+        if(opts->run)
+            emit_run(def->machine_list, param, ctx_arg);
+    }
     emit_section(last_part);
 
     emit_amble(def->postamble);
+
+    if(NULL != opts->trace)
+        emit_decoder(def->machine_list, opts->trace);
 }
 
 
@@ -324,13 +3312,14 @@ void emit_definition(definition_t *def, char *name) {
 int main(void) {
 
     definition_t *def;
+    emit_options_t options = { BACKEND_TABLE };
 
     def = get_definition("scanner.sm");
 
     if(validate(def) != 0)
         return 1;
 
-    emit_definition(def, "outtest.c");
+    emit_definition(def, "outtest.c", &options);
 
     free_definition(def);
 
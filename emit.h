@@ -2,6 +2,30 @@
 #ifndef EMIT_H
 #define EMIT_H
 
-void emit_definition(definition_t *def, char *name);
+// code generation backends, selected with -b: on the command line
+enum {
+    BACKEND_TABLE,  // static const tables shared by every call (default)
+    BACKEND_STACK,  // tables are rebuilt on the stack every time a machine runs
+    BACKEND_SWITCH, // nested switch statements with direct calls to the actions
+    BACKEND_GOTO,   // computed goto from state to state (GCC and Clang)
+    BACKEND_TAIL,   // a function for every state that tail calls the next one
+    BACKEND_BINARY, // a table file for the runtime in smtable.c instead of C
+    BACKEND_CPP,    // a C++17 header with a class template for every machine
+};
+
+typedef struct {
+    int backend;
+    char *context;  // type of the ctx pointer passed to everything, or NULL
+    int batch;      // also emit a batch runner for arrays of transitions
+    int parallel;   // also emit a runner that splits a buffer across threads
+    int lanes;      // also emit a runner that steps many records in the lanes of a vector
+    int push;       // also emit the sm_feed() push API
+    int skip;       // sm_feed() skips bytes that loop in place without an action
+    int run;        // also emit sm_run() to run nested machines on a stack
+    int instrument; // also emit a counter for every state and transition
+    char *trace;    // also emit the ring buffer tracer, and its decoder to this file
+} emit_options_t;
+
+void emit_definition(definition_t *def, char *name, emit_options_t *opts);
 
 #endif /* EMIT_H */
@@ -4,7 +4,7 @@
 
 #define SERROR(t, fmt, ... ) show_error(t, __FILE__, __LINE__, fmt, ## __VA_ARGS__)
 #define PERROR(n, fmt, ... ) show_error(EPARSE_ERROR, n, 0, fmt, ## __VA_ARGS__)
-#define ALLOC(t)    allocate_mem(__FILE__, __LINE__, sizeof(#t))
+#define ALLOC(t)    (t *)allocate_mem(__FILE__, __LINE__, sizeof(t))
 #define STRDUP(s)   string_dup(__FILE__, __LINE__, s)
 
 enum {
@@ -12,15 +12,54 @@
 #include "files.h"
 #include "errors.h"
 #include "validate.h"
+#include "optimize.h"
+#include "profile.h"
+
+static char *infile = NULL, *outfile = NULL, *profile = NULL;
+static int inline_machines = 1;
+static emit_options_t options = { BACKEND_TABLE };
 
-static char *infile = NULL, *outfile = NULL;
 static char *use_message[] = {
-    "use: -i:inputfilename -o:outputfilename",
+    "use: -i:inputfilename -o:outputfilename [-b:backend] [-c:type] [-a] [-j] [-l] [-p] [-k] [-s] [-n] [-t:decoder] [-f:profile] [-x]",
     "  -i:name   Specify the file to read from",
     "  -o:name   Specify the file to write to",
+    "  -b:name   Select the code generation backend",
+    "            table  static const tables shared by all calls (default)",
+    "            stack  tables built on the stack for every call",
+    "            switch nested switch statements that call the actions directly",
+    "            goto   computed goto from state to state (GCC and Clang only)",
+    "            tail   a function for every state that tail calls the next one",
+    "            binary a table file that the runtime in smtable.c maps and runs",
+    "            cpp    a C++17 header with a class template for every machine",
+    "  -c:type   Pass a \"type *ctx\" to every machine, action and input function",
+    "  -a        Also emit M_batch() to run a machine over an array (table only)",
+    "  -j        Also emit M_parallel() to run a buffer on threads (table, needs -c)",
+    "  -l        Also emit M_lanes() to run many records in lockstep (table, needs -c)",
+    "  -p        Also emit sm_feed() to push data into the machines (table only)",
+    "  -k        Let sm_feed() skip bytes that loop in a state without an action",
+    "  -s        Also emit sm_run() to run nested machines on a stack (table only)",
+    "  -n        Count every state and transition when built with INSTRUMENT",
+    "  -t:name   Record every transition in a ring when built with TRACE, and",
+    "            write a program that decodes the records to this file",
+    "  -f:name   Lay the machines out by the counts in a dump_counters() file",
+    "  -x        Do not copy small machines into the machines that call them",
     NULL
 };
 
+static struct {
+    char *name;
+    int backend;
+} backends[] = {
+    {"table",   BACKEND_TABLE},
+    {"stack",   BACKEND_STACK},
+    {"switch",  BACKEND_SWITCH},
+    {"goto",    BACKEND_GOTO},
+    {"tail",    BACKEND_TAIL},
+    {"binary",  BACKEND_BINARY},
+    {"cpp",     BACKEND_CPP},
+    {NULL, -1}
+};
+
 static void show_use(void) {
 
     int i;
@@ -29,9 +68,37 @@ static void show_use(void) {
         fprintf(stderr, "%s\n", use_message[i]);
 }
 
+static int select_backend(char *name) {
+
+    int i;
+
+    for(i = 0; backends[i].name != NULL; i++) {
+        if(!strcmp(backends[i].name, name)) {
+            options.backend = backends[i].backend;
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "ERROR: Unknown backend: %s\n", name);
+    show_use();
+    return -1;
+}
+
 /*
  *  -i:filename
  *  -o:filename
+ *  -b:backend
+ *  -c:type
+ *  -a
+ *  -j
+ *  -l
+ *  -p
+ *  -k
+ *  -s
+ *  -n
+ *  -t:decoder
+ *  -f:profile
+ *  -x
  */
 static int cmd_line(int argc, char **argv) {
 
@@ -61,12 +128,98 @@ static int cmd_line(int argc, char **argv) {
                 }
                 infile = &argv[i][3];
                 break;
+            case 'b':
+                if(select_backend(&argv[i][3]))
+                    return -1;
+                break;
+            case 'c':
+                if(NULL != options.context) {
+                    fprintf(stderr, "ERROR: Only one context type may be specified\n");
+                    show_use();
+                    return -1;
+                }
+                options.context = &argv[i][3];
+                break;
+            case 'a':
+                options.batch = 1;
+                break;
+            case 'j':
+                options.parallel = 1;
+                break;
+            case 'l':
+                options.lanes = 1;
+                break;
+            case 'p':
+                options.push = 1;
+                break;
+            case 'k':
+                options.skip = 1;
+                break;
+            case 's':
+                options.run = 1;
+                break;
+            case 'n':
+                options.instrument = 1;
+                break;
+            case 't':
+                if(NULL != options.trace) {
+                    fprintf(stderr, "ERROR: Only one decoder may be specified\n");
+                    show_use();
+                    return -1;
+                }
+                options.trace = &argv[i][3];
+                break;
+            case 'x':
+                inline_machines = 0;
+                break;
+            case 'f':
+                if(NULL != profile) {
+                    fprintf(stderr, "ERROR: Only one profile may be specified\n");
+                    show_use();
+                    return -1;
+                }
+                profile = &argv[i][3];
+                break;
             default:
                 fprintf(stderr, "ERROR: Unknown command line: %s\n", argv[i]);
                 show_use();
                 return -1;
         }
     }
+    if((options.push || options.batch || options.run || options.parallel || options.lanes)
+            && options.backend != BACKEND_TABLE) {
+        fprintf(stderr, "ERROR: The push, batch, parallel, lockstep and stack APIs are only emitted with the table backend\n");
+        return -1;
+    }
+    if((options.backend == BACKEND_BINARY || options.backend == BACKEND_CPP)
+            && (options.instrument || NULL != options.trace)) {
+        fprintf(stderr, "ERROR: The counters and the tracer are only emitted as C source\n");
+        return -1;
+    }
+    if(options.backend == BACKEND_CPP && NULL != options.context) {
+        fprintf(stderr, "ERROR: The C++ backend passes the handler instead of a context\n");
+        return -1;
+    }
+    if(options.parallel && NULL == options.context) {
+        fprintf(stderr, "ERROR: The parallel runner (-j) needs a context (-c) for the actions of every chunk\n");
+        return -1;
+    }
+    if(options.parallel && (options.instrument || NULL != options.trace)) {
+        fprintf(stderr, "ERROR: The parallel runner (-j) is not counted or traced, so it cannot be used with -n or -t\n");
+        return -1;
+    }
+    if(options.lanes && NULL == options.context) {
+        fprintf(stderr, "ERROR: The lockstep runner (-l) needs a context (-c) for the actions of every record\n");
+        return -1;
+    }
+    if(options.lanes && (options.instrument || NULL != options.trace)) {
+        fprintf(stderr, "ERROR: The lockstep runner (-l) is not counted or traced, so it cannot be used with -n or -t\n");
+        return -1;
+    }
+    if(options.skip && !options.push) {
+        fprintf(stderr, "ERROR: Skipping bytes (-k) needs the push API (-p)\n");
+        return -1;
+    }
     return 0;
 }
 
@@ -83,7 +236,12 @@ int main(int argc, char **argv) {
     if(validate(def) != 0)
         return 1;
 
-    emit_definition(def, outfile);
+    optimize(def, inline_machines);
+
+    if(NULL != profile && read_profile(def, profile) != 0)
+        return 1;
+
+    emit_definition(def, outfile, &options);
 
     free_definition(def);
     printf("input file: %s\n", infile);
@@ -0,0 +1,472 @@
+/*
+ *  The purpose of this module is to simplify the definition before it is
+ *  handed to the emitter.  It is run after the definition is validated.
+ *
+ *  1.  Merge states that are equivalent.  Two states are equivalent when every
+ *      transition calls the same function and goes to equivalent states. The
+ *      states are found with partition refinement, the same way a DFA is
+ *      minimized.  Every class of equivalent states is replaced by the first
+ *      state in the state list, so the START state is never removed.
+ *
+ *  2.  Copy small machines into the machines that call them, before the
+ *      states are merged.  The states of the callee become states of the
+ *      caller, so the caller does not have to call a function and set up a
+ *      table for every call.  See can_inline() for when this is done.  The
+ *      machines that are not called any more after that are removed, so
+ *      they are not emitted as functions that nothing calls.  This can be
+ *      turned off with "-x" on the command line.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "parse.h"
+#include "errors.h"
+
+// machines with more states than this are always called.
+#define INLINE_STATES 4
+
+/*
+ *  Return the number of the named state.  END and ERROR come after all of the
+ *  states in the list.
+ */
+static int state_number(machine_t *mac, char *name) {
+
+    string_list_t *lst;
+    int i;
+
+    for(lst = mac->states, i = 0; lst != NULL; lst = lst->next, i++) {
+        if(!strcmp(lst->strg, name))
+            return i;
+    }
+
+    if(!strcmp(name, "END"))
+        return mac->num_states;
+    else if(!strcmp(name, "ERROR"))
+        return mac->num_states + 1;
+
+    PERROR(name, "Used as a state but is not defined in the state list");
+    return -1;
+}
+
+/*
+ *  Split the classes until no more states can be told apart.  The classes are
+ *  numbered in the order that their first state is seen, so the first state
+ *  of every class is the one that is kept.  END and ERROR are never merged,
+ *  and they get the class numbers after all of the states.
+ */
+static int refine(machine_t *mac, transition_t ***rows, int **next, int *cls) {
+
+    int *work, count = 1, prev = 0;
+    int n = mac->num_states;
+    int i, j, k, same;
+
+    if(NULL == (work = calloc(n, sizeof(int))))
+        SERROR(FATAL_ERROR, "Cannot allocate class list");
+
+    while(count != prev) {
+        prev = count;
+        count = 0;
+        for(i = 0; i < n; i++) {
+            work[i] = -1;
+            for(j = 0; j < i && work[i] < 0; j++) {
+                if(cls[i] != cls[j])
+                    continue;
+                for(k = 0, same = 1; k < mac->num_trans && same; k++) {
+                    if(strcmp(rows[i][k]->func, rows[j][k]->func))
+                        same = 0;
+                    else if(((next[i][k] < n)? cls[next[i][k]]: next[i][k]) !=
+                            ((next[j][k] < n)? cls[next[j][k]]: next[j][k]))
+                        same = 0;
+                }
+                if(same)
+                    work[i] = work[j];
+            }
+            if(work[i] < 0)
+                work[i] = count++;
+        }
+        memcpy(cls, work, n * sizeof(int));
+    }
+
+    free(work);
+    return count;
+}
+
+/*
+ *  Remove the merged states from the machine and point all of the transitions
+ *  that used them at the state that was kept.
+ */
+static void rewrite(machine_t *mac, int **next, int *cls, int *keep) {
+
+    string_list_t *lst, **lptr;
+    state_def_t *sd, **sptr;
+    transition_t *tran;
+    char **names;
+    int i, j, n = mac->num_states;
+
+    if(NULL == (names = calloc(n, sizeof(char*))))
+        SERROR(FATAL_ERROR, "Cannot allocate name list");
+
+    for(lst = mac->states, i = 0; lst != NULL; lst = lst->next, i++)
+        names[i] = lst->strg;
+
+    for(sd = mac->list; sd != NULL; sd = sd->next) {
+        for(tran = sd->list; tran != NULL; tran = tran->next) {
+            j = state_number(mac, tran->state);
+            if(j >= 0 && j < n && keep[cls[j]] != j) {
+                free(tran->state);
+                if(NULL == (tran->state = strdup(names[keep[cls[j]]])))
+                    SERROR(FATAL_ERROR, "Cannot allocate state name");
+            }
+        }
+    }
+
+    for(i = 0; i < n; i++) {
+        if(keep[cls[i]] == i)
+            continue;
+
+        for(sptr = &mac->list; *sptr != NULL; sptr = &(*sptr)->next) {
+            if(!strcmp((*sptr)->name, names[i])) {
+                sd = *sptr;
+                *sptr = sd->next;
+                free_state_def(sd);
+                mac->num_state_defs--;
+                break;
+            }
+        }
+    }
+
+    for(lptr = &mac->states, i = 0; *lptr != NULL; i++) {
+        lst = *lptr;
+        if(keep[cls[i]] != i) {
+            *lptr = lst->next;
+            free(lst->strg);
+            free(lst);
+            mac->num_states--;
+        }
+        else
+            lptr = &lst->next;
+    }
+
+    free(names);
+}
+
+/*
+ *  Merge all of the equivalent states in one machine.  Returns the number of
+ *  states that were removed.
+ */
+static int minimize(machine_t *mac) {
+
+    transition_t ***rows;
+    string_list_t *lst, *tlst;
+    state_def_t *sd;
+    int **next, *cls, *keep;
+    int n = mac->num_states;
+    int i, k, count, merged = 0;
+
+    if(n < 2)
+        return 0;
+
+    rows = calloc(n, sizeof(transition_t**));
+    next = calloc(n, sizeof(int*));
+    cls = calloc(n, sizeof(int));
+    keep = calloc(n, sizeof(int));
+    if(NULL == rows || NULL == next || NULL == cls || NULL == keep)
+        SERROR(FATAL_ERROR, "Cannot allocate state lists");
+
+    for(lst = mac->states, i = 0; lst != NULL; lst = lst->next, i++) {
+        if(NULL == (sd = select_state(mac, lst->strg)))
+            goto done;
+
+        rows[i] = calloc(mac->num_trans, sizeof(transition_t*));
+        next[i] = calloc(mac->num_trans, sizeof(int));
+        if(NULL == rows[i] || NULL == next[i])
+            SERROR(FATAL_ERROR, "Cannot allocate state row");
+
+        for(tlst = mac->trans, k = 0; tlst != NULL; tlst = tlst->next, k++) {
+            if(NULL == (rows[i][k] = select_trans(sd, tlst->strg)))
+                goto done;
+            if(0 > (next[i][k] = state_number(mac, rows[i][k]->state)))
+                goto done;
+        }
+    }
+
+    count = refine(mac, rows, next, cls);
+    if(count < n) {
+        for(i = n - 1; i >= 0; i--)
+            keep[cls[i]] = i;
+        rewrite(mac, next, cls, keep);
+        merged = n - count;
+    }
+
+done:
+    for(i = 0; i < n; i++) {
+        if(NULL != rows[i])
+            free(rows[i]);
+        if(NULL != next[i])
+            free(next[i]);
+    }
+    free(rows);
+    free(next);
+    free(cls);
+    free(keep);
+    return merged;
+}
+
+static int same_list(string_list_t *a, string_list_t *b) {
+
+    for(; a != NULL && b != NULL; a = a->next, b = b->next) {
+        if(strcmp(a->strg, b->strg))
+            return 0;
+    }
+    return (a == NULL && b == NULL);
+}
+
+static machine_t *find_machine(definition_t *def, char *name) {
+
+    machine_t *mac;
+
+    for(mac = def->machine_list; mac != NULL; mac = mac->next) {
+        if(!strcmp(mac->name, name))
+            return mac;
+    }
+    return NULL;
+}
+
+/*
+ *  Add a string to the end of the list.  The list owns the string after this.
+ */
+static void append_string(string_list_t **list, char *strg) {
+
+    string_list_t *elem;
+
+    if(NULL == (elem = calloc(1, sizeof(string_list_t))))
+        SERROR(FATAL_ERROR, "Cannot allocate the string list element");
+    elem->strg = strg;
+
+    while(*list != NULL)
+        list = &(*list)->next;
+    *list = elem;
+}
+
+static char *copy_string(char *strg) {
+
+    char *str;
+
+    if(NULL == (str = strdup(strg)))
+        SERROR(FATAL_ERROR, "Cannot allocate a string");
+    return str;
+}
+
+/*
+ *  Return the name of the copy of a state of the callee that returns to the
+ *  state ret of the caller when it is finished.
+ */
+static char *copy_name(machine_t *callee, char *state, char *ret) {
+
+    char *name;
+    size_t len = strlen(callee->name) + strlen(state) + strlen(ret) + 3;
+
+    if(NULL == (name = malloc(len)))
+        SERROR(FATAL_ERROR, "Cannot allocate a state name");
+    snprintf(name, len, "%s_%s_%s", callee->name, state, ret);
+    return name;
+}
+
+/*
+ *  A callee can be copied into the caller when it reads the same input with
+ *  the same transitions and is small.  The pre_code becomes the action of the
+ *  transition that enters the copy, so it must be a function that looks like
+ *  an action.  There is nowhere to put a post_code, so a callee with one is
+ *  always called.  END and ERROR of the callee both go to the state that the
+ *  caller would have gone to when the call returned, the same as a call.
+ */
+static int count_defs(machine_t *mac) {
+
+    state_def_t *sd;
+    int count = 0;
+
+    for(sd = mac->list; sd != NULL; sd = sd->next)
+        count++;
+    return count;
+}
+
+static int can_inline(machine_t *caller, machine_t *callee) {
+
+    if(caller == callee || NULL != callee->postcode)
+        return 0;
+    if(callee->num_states > INLINE_STATES || callee->num_states != count_defs(callee))
+        return 0;
+    if(NULL == caller->input || NULL == callee->input || strcmp(caller->input, callee->input))
+        return 0;
+    return same_list(caller->trans, callee->trans);
+}
+
+/*
+ *  Add the states of the callee to the caller, once for every state that the
+ *  calls return to.
+ */
+static void copy_machine(machine_t *caller, machine_t *callee, char *ret) {
+
+    string_list_t *lst;
+    state_def_t *sd, *nsd;
+    transition_t *tran, *ntran, **tptr;
+    char *name = copy_name(callee, "START", ret);
+
+    for(lst = caller->states; lst != NULL; lst = lst->next) {
+        if(!strcmp(lst->strg, name)) {
+            free(name);
+            return;
+        }
+    }
+    free(name);
+
+    for(sd = callee->list; sd != NULL; sd = sd->next) {
+        if(NULL == (nsd = calloc(1, sizeof(state_def_t))))
+            SERROR(FATAL_ERROR, "Cannot allocate state definition");
+        nsd->name = copy_name(callee, sd->name, ret);
+
+        tptr = &nsd->list;
+        for(tran = sd->list; tran != NULL; tran = tran->next) {
+            if(NULL == (ntran = calloc(1, sizeof(transition_t))))
+                SERROR(FATAL_ERROR, "Cannot allocate transition structure");
+            for(lst = tran->list; lst != NULL; lst = lst->next)
+                append_string(&ntran->list, copy_string(lst->strg));
+            if(!strcmp(tran->state, "END") || !strcmp(tran->state, "ERROR"))
+                ntran->state = copy_string(ret);
+            else
+                ntran->state = copy_name(callee, tran->state, ret);
+            ntran->func = copy_string(tran->func);
+            *tptr = ntran;
+            tptr = &ntran->next;
+        }
+
+        nsd->next = caller->list;
+        caller->list = nsd;
+        caller->num_state_defs++;
+        append_string(&caller->states, copy_string(nsd->name));
+        caller->num_states++;
+    }
+}
+
+/*
+ *  Replace the calls of small machines with copies of them.  Only the states
+ *  that were there to begin with are looked at, so the copies keep calling
+ *  the machines that they call.  Returns the number of calls replaced.
+ */
+static int inline_calls(definition_t *def, machine_t *mac) {
+
+    state_def_t *sd, *first = mac->list;
+    transition_t *tran;
+    machine_t *callee;
+    char *ret;
+    int count = 0;
+
+    for(sd = first; sd != NULL; sd = sd->next) {
+        for(tran = sd->list; tran != NULL; tran = tran->next) {
+            callee = find_machine(def, tran->func);
+            if(NULL == callee || !can_inline(mac, callee))
+                continue;
+
+            ret = tran->state;
+            copy_machine(mac, callee, ret);
+            tran->state = copy_name(callee, "START", ret);
+            free(ret);
+            free(tran->func);
+            tran->func = copy_string((NULL != callee->precode)? callee->precode: "nop");
+            count++;
+        }
+    }
+    return count;
+}
+
+/*
+ *  Return non-zero if the name is in the text as a word of its own, so that
+ *  a call in inline code or a prototype in the preamble is found.
+ */
+static int names_machine(char *text, char *name) {
+
+    size_t len = strlen(name);
+    char *str;
+
+    if(NULL == text)
+        return 0;
+    for(str = strstr(text, name); str != NULL; str = strstr(str + 1, name)) {
+        if((str == text || !(isalnum((unsigned char)str[-1]) || str[-1] == '_'))
+                && !(isalnum((unsigned char)str[len]) || str[len] == '_'))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ *  Return non-zero if the machine is named anywhere in the definition other
+ *  than its own name: by a transition, in inline code or in the user code.
+ */
+static int is_called(definition_t *def, machine_t *callee) {
+
+    machine_t *mac;
+    state_def_t *sd;
+    transition_t *tran;
+
+    if(names_machine(def->preamble, callee->name) || names_machine(def->postamble, callee->name))
+        return 1;
+    for(mac = def->machine_list; mac != NULL; mac = mac->next) {
+        if(names_machine(mac->precode, callee->name) || names_machine(mac->postcode, callee->name))
+            return 1;
+        for(sd = mac->list; sd != NULL; sd = sd->next)
+            for(tran = sd->list; tran != NULL; tran = tran->next)
+                if(names_machine(tran->func, callee->name))
+                    return 1;
+    }
+    return 0;
+}
+
+/*
+ *  Remove the machines that were called before the calls were inlined and
+ *  are not named anywhere any more.  A machine that the user code names,
+ *  even only in a prototype, is always kept.
+ */
+static void remove_inlined(definition_t *def, int *called) {
+
+    machine_t **mptr = &def->machine_list, *mac;
+    int i;
+
+    for(i = 0; NULL != (mac = *mptr); i++) {
+        if(called[i] && !is_called(def, mac)) {
+            printf("%s: inlined into every caller, removed\n", mac->name);
+            *mptr = mac->next;
+            free_machine(mac);
+        }
+        else
+            mptr = &mac->next;
+    }
+}
+
+int optimize(definition_t *def, int inline_machines) {
+
+    machine_t *mac;
+    int merged, inlined, *called, i;
+
+    for(mac = def->machine_list, i = 0; mac != NULL; mac = mac->next)
+        i++;
+    if(NULL == (called = calloc(i + 1, sizeof(int))))
+        SERROR(FATAL_ERROR, "Cannot allocate the list of called machines");
+    for(mac = def->machine_list, i = 0; mac != NULL; mac = mac->next, i++)
+        called[i] = is_called(def, mac);
+
+    for(mac = def->machine_list; mac != NULL; mac = mac->next) {
+        inlined = (inline_machines)? inline_calls(def, mac): 0;
+        merged = minimize(mac);
+        printf("%s: inlined %d call%s, merged %d equivalent state%s, %d left\n",
+                mac->name, inlined, (inlined == 1)? "": "s",
+                merged, (merged == 1)? "": "s", mac->num_states);
+    }
+
+    if(inline_machines)
+        remove_inlined(def, called);
+    free(called);
+    return 0;
+}
@@ -0,0 +1,7 @@
+
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+int optimize(definition_t *def, int inline_machines);
+
+#endif /* OPTIMIZE_H */
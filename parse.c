@@ -170,6 +170,152 @@ static int get_list(string_list_t **list, int sep, int term) {
     return 0; // never happens
 }
 
+/*
+ *  Decode one character of a character set, which may be a C escape, and
+ *  return the number of characters of the string that it used.
+ */
+static int set_char(char *strg, int *ch) {
+
+    int i;
+
+    if(strg[0] != '\\' || strg[1] == 0) {
+        *ch = (unsigned char)strg[0];
+        return 1;
+    }
+
+    switch(strg[1]) {
+        case 'n': *ch = '\n'; break;
+        case 'r': *ch = '\r'; break;
+        case 't': *ch = '\t'; break;
+        case '0': *ch = 0; break;
+        case 'x':
+            for(i = 2, *ch = 0; i < 4 && isxdigit(strg[i]); i++)
+                *ch = *ch * 16 + (isdigit(strg[i])? strg[i] - '0': tolower(strg[i]) - 'a' + 10);
+            return i;
+        default: *ch = (unsigned char)strg[1]; break;
+    }
+    return 2;
+}
+
+/*
+ *  Add the characters of a quoted string to a set.  "a-z" is a range, and a
+ *  '-' at either end of the string stands for itself.
+ */
+static int add_to_set(char_set_t *set, char *strg) {
+
+    int lo, hi;
+
+    while(*strg != 0) {
+        strg += set_char(strg, &lo);
+        hi = lo;
+        if(strg[0] == '-' && strg[1] != 0)
+            strg += 1 + set_char(&strg[1], &hi);
+        if(hi < lo) {
+            SERROR(SYNTAX_ERROR, "The range in the set of \"%s\" is backwards", set->name);
+            return 1;
+        }
+        for(; lo <= hi; lo++)
+            set->bytes[lo] = 1;
+    }
+    return 0;
+}
+
+/*
+ *  Read the character set of a transition.  It is one or more quoted strings
+ *  or the word DEFAULT, and it is ended by the ',' or ';' that ends the
+ *  transition, which is put back for the caller.
+ */
+static int get_char_set(definition_t *def, char *name) {
+
+    token_t *tok;
+    char_set_t *set;
+    int items = 0;
+
+    for(set = def->char_sets; set != NULL; set = set->next) {
+        if(!strcmp(set->name, name)) {
+            SERROR(SYNTAX_ERROR, "The set of \"%s\" is already defined", name);
+            return 1;
+        }
+    }
+
+    if(NULL == (set = calloc(1, sizeof(char_set_t))))
+        SERROR(FATAL_ERROR, "Cannot allocate the character set");
+    if(NULL == (set->name = strdup(name)))
+        SERROR(FATAL_ERROR, "Cannot allocate the character set name");
+    set->next = def->char_sets;
+    def->char_sets = set;
+
+    do {
+        tok = get_token();
+        if(QSTRG_SYMBOL == tok->type) {
+            if(add_to_set(set, tok->strg))
+                return 1;
+        }
+        else if(UNKNOWN_SYMBOL == tok->type && !strcmp(tok->strg, "DEFAULT"))
+            set->is_default = 1;
+        else if(items > 0 && (COMMA_SYMBOL == tok->type || SEMI_SYMBOL == tok->type)) {
+            unget_token(tok);
+            return 0;
+        }
+        else {
+            SERROR(SYNTAX_ERROR, "Expected a quoted string or DEFAULT but got a \"%s\" token", tok->strg);
+            return 1;
+        }
+        free_token(tok);
+        items++;
+    } while(1);
+
+    return 1; // never happens
+}
+
+/*
+ *  Read the transition list, which is the same as get_list() except that
+ *  every name may be followed by '=' and a character set.
+ */
+static int get_trans_list(definition_t *def, string_list_t **list) {
+
+    token_t *tok;
+    int items = 0;
+
+    do {
+        // get the name
+        tok = get_token();
+        if(UNKNOWN_SYMBOL == tok->type) {
+            add_to_string_list(list, tok->strg);
+            items++;
+        }
+        else {
+            SERROR(SYNTAX_ERROR, "Expected  a name but got a \"%s\" token", tok->strg);
+            free_string_list(*list);
+            return 0;
+        }
+        free_token(tok);
+
+        // get a '=', a ',' or a ';'.  If it is the ';', then exit.
+        tok = get_token();
+        if(EQUAL_SYMBOL == tok->type) {
+            free_token(tok);
+            if(get_char_set(def, (*list)->strg)) {
+                free_string_list(*list);
+                return 0;
+            }
+            tok = get_token();
+        }
+        if(SEMI_SYMBOL == tok->type) {
+            return items;
+        }
+        else if(COMMA_SYMBOL != tok->type) {
+            SERROR(SYNTAX_ERROR, "Unexpected \"%s\" token", tok->strg);
+            free_string_list(*list);
+            return 0;
+        }
+        free_token(tok);
+    } while(1);
+
+    free_string_list(*list);
+    return 0; // never happens
+}
+
 static int state_definition(machine_t *machine) {
 
     token_t *tok;
@@ -320,6 +466,23 @@ static int machine_definition(definition_t *def) {
                 }
                 break;
 
+            case CLASSIFY_SYMBOL:
+                if(machine->classify != NULL) {
+                    SERROR(SYNTAX_ERROR, "Only one \"classify\" directive is allowed per machine");
+                    errors++;
+                    finished = 1;
+                    break; // return parse_errors;
+                }
+
+                machine->classify = get_single();
+                if(NULL == machine->classify) {
+                    SERROR(PARSE_ERROR, "Cannot read classify specification");
+                    errors++;
+                    finished = 1;
+                    break; // return parse_errors;
+                }
+                break;
+
             case PRECODE_SYMBOL:
                 if(machine->precode != NULL) {
                     SERROR(SYNTAX_ERROR, "Only one \"precode\" directive is allowed per machine");
@@ -354,6 +517,40 @@ static int machine_definition(definition_t *def) {
                 }
                 break;
 
+            case LAYOUT_SYMBOL:
+                if(machine->layout != NULL) {
+                    SERROR(SYNTAX_ERROR, "Only one \"layout\" directive is allowed per machine");
+                    errors++;
+                    finished = 1;
+                    break; // return parse_errors;
+                }
+
+                machine->layout = get_single();
+                if(NULL == machine->layout) {
+                    SERROR(PARSE_ERROR, "Cannot read layout specification");
+                    errors++;
+                    finished = 1;
+                    break; // return parse_errors;
+                }
+                break;
+
+            case NOOP_SYMBOL:
+                if(machine->no_ops != NULL) {
+                    SERROR(SYNTAX_ERROR, "Only one \"no_op\" directive is allowed per machine");
+                    errors++;
+                    finished = 1;
+                    break; // return parse_errors;
+                }
+
+                get_list(&machine->no_ops, COMMA_SYMBOL, SEMI_SYMBOL);
+                if(NULL == machine->no_ops) {
+                    SERROR(PARSE_ERROR, "Cannot read no_op list specification");
+                    errors++;
+                    finished = 1;
+                    break; // return parse_errors;
+                }
+                break;
+
             case TRANS_SYMBOL:
                 if(machine->trans != NULL) {
                     SERROR(SYNTAX_ERROR, "Only one \"transitions\" directive is allowed per machine");
@@ -362,7 +559,7 @@ static int machine_definition(definition_t *def) {
                     break; // return parse_errors;
                 }
 
-                machine->num_trans  = get_list(&machine->trans, COMMA_SYMBOL, SEMI_SYMBOL);
+                machine->num_trans  = get_trans_list(def, &machine->trans);
                 if(NULL == machine->trans) {
                     SERROR(PARSE_ERROR, "Cannot read transition list specification");
                     errors++;
@@ -518,6 +715,26 @@ static void free_state_list(state_def_t *state_def) {
     }
 }
 
+/*
+ *  Free a single state definition that has been removed from its machine.
+ */
+void free_state_def(state_def_t *state_def) {
+
+    state_def->next = NULL;
+    free_state_list(state_def);
+}
+
+static void free_machine_list(machine_t *machine);
+
+/*
+ *  Free a single machine that has been removed from the definition.
+ */
+void free_machine(machine_t *mac) {
+
+    mac->next = NULL;
+    free_machine_list(mac);
+}
+
 static void free_machine_list(machine_t *machine) {
 
     machine_t *mac, *next;
@@ -526,16 +743,26 @@ static void free_machine_list(machine_t *machine) {
         next = mac->next;
         if(NULL != mac->name)
             free(mac->name);
+        if(NULL != mac->classify)
+            free(mac->classify);
         if(NULL != mac->precode)
             free(mac->precode);
         if(NULL != mac->postcode)
             free(mac->postcode);
+        if(NULL != mac->layout)
+            free(mac->layout);
         if(NULL != mac->trans)
             free_string_list(mac->trans);
         if(NULL != mac->states)
             free_string_list(mac->states);
+        if(NULL != mac->no_ops)
+            free_string_list(mac->no_ops);
         if(NULL != mac->list)
             free_state_list(mac->list);
+        if(NULL != mac->chars)
+            free(mac->chars);
+        if(NULL != mac->counts)
+            free(mac->counts);
         free(mac);
     }
 }
@@ -543,14 +770,62 @@ static void free_machine_list(machine_t *machine) {
 /*
  *  External user interface.
  */
+
+/*
+ *  Find the definition of a state in a machine.
+ */
+state_def_t *select_state(machine_t *mac, char *name) {
+
+    state_def_t *state;
+    for(state = mac->list; state != NULL; state = state->next) {
+        if(!strcmp(state->name, name))
+            return state;
+    }
+
+    PERROR(name, "Defined in the state list but does not have a definition");
+    return NULL;
+}
+
+/*
+ *  Find the transition that a state takes for the named transition.  If it is
+ *  not listed, then the DEFAULT transition is used.
+ */
+transition_t *select_trans(state_def_t *state, char *name) {
+
+    transition_t *tran, *def = NULL;
+    string_list_t *lst;
+
+    for(tran = state->list; tran!= NULL; tran = tran->next) {
+        for(lst = tran->list; lst != NULL; lst = lst->next)
+            if(!strcmp(lst->strg, name))
+                return tran;
+            else if(!strcmp(lst->strg, "DEFAULT"))
+                def = tran;
+    }
+
+    if(def != NULL)
+        return def;
+    else {
+        PERROR(name, "Defined in the trans list but does not have a definition");
+        return NULL;
+    }
+}
+
 void free_definition(definition_t *def) {
 
+    char_set_t *set, *next;
+
     if(NULL != def) {
         if(NULL != def->preamble)
             free(def->preamble);
         if(NULL != def->postamble)
             free(def->postamble);
         free_machine_list(def->machine_list);
+        for(set = def->char_sets; set != NULL; set = next) {
+            next = set->next;
+            free(set->name);
+            free(set);
+        }
         free(def);
     }
 }
@@ -624,6 +899,10 @@ static void dump_mac(machine_t *mac) {
         printf("    INPUT: %s\n", mac->input);
     else
         printf("    INPUT: (none defined)\n");
+    if(mac->classify != NULL)
+        printf("    CLASSIFY: %s\n", mac->classify);
+    else
+        printf("    CLASSIFY: (none defined)\n");
     if(mac->precode != NULL)
         printf("    PRECODE: %s\n", mac->precode);
     else
@@ -632,6 +911,10 @@ static void dump_mac(machine_t *mac) {
         printf("    POSTCODE: %s\n", mac->postcode);
     else
         printf("    POSTCODE: (none defined)\n");
+    if(mac->layout != NULL)
+        printf("    LAYOUT: %s\n", mac->layout);
+    else
+        printf("    LAYOUT: (none defined)\n");
     if(mac->states != NULL) {
         printf("    STATES:\n");
         dump_list(mac->states);
@@ -644,6 +927,12 @@ static void dump_mac(machine_t *mac) {
     }
     else
         printf("    TRANSITIONS:\n        NONE\n");
+    if(mac->no_ops != NULL) {
+        printf("    NO_OPS:\n");
+        dump_list(mac->no_ops);
+    }
+    else
+        printf("    NO_OPS:\n        NONE\n");
     dump_states(mac->list);
 }
 
@@ -50,6 +50,18 @@ typedef struct state_def_t {
     struct state_def_t *next;
 } state_def_t;
 
+/*
+ *  The bytes that a transition name stands for.  A machine whose transitions
+ *  have sets reads a byte with its input function, and the byte is turned
+ *  into the transition with a table.
+ */
+typedef struct char_set_t {
+    char *name;
+    int is_default;             // every byte that is not in another set
+    unsigned char bytes[256];   // 1 for every byte in the set
+    struct char_set_t *next;
+} char_set_t;
+
 /*
  *  This is the complete machine with all of the states and transitions ready
  *  to be converted into the state transition table.
@@ -57,8 +69,10 @@ typedef struct state_def_t {
 typedef struct machine_t {
     char *name;
     char *input;
+    char *classify; // turns one datum into a transition for the push API
     char *precode;
     char *postcode;
+    char *layout;   // table layout, "dense" or "comb".  NULL is dense.
 
     int num_trans;  // number of columns in the state transition table.
 
@@ -68,8 +82,11 @@ typedef struct machine_t {
 
     string_list_t *trans;   // transition enum names
     string_list_t *states;  // state enum names
+    string_list_t *no_ops;  // actions that are declared to do nothing
 
     struct state_def_t *list;   // list of states with the transitions
+    unsigned char *chars;       // the transition of every byte, or NULL
+    unsigned long long *counts; // the profile, [state][trans], or NULL
 
     struct machine_t *next; // next machine definition
 } machine_t;
@@ -81,10 +98,15 @@ typedef struct {
     char *preamble;
     char *postamble;
     inline_list_t *inline_list;
+    char_set_t *char_sets;
     machine_t *machine_list;
 } definition_t;
 
 definition_t *get_definition(char *name);
 void free_definition(definition_t *def);
+void free_state_def(state_def_t *state_def);
+void free_machine(machine_t *mac);
+state_def_t *select_state(machine_t *mac, char *name);
+transition_t *select_trans(state_def_t *state, char *name);
 
 #endif /* PARSE_H */
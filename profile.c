@@ -0,0 +1,153 @@
+/*
+ *  The purpose of this module is to read the counters that an instrumented
+ *  build printed with dump_counters(), so that the emitter can lay the
+ *  machines out for the way they are really used.  It is run after the
+ *  definition is optimized, because the counters name the states that the
+ *  optimizer left.
+ *
+ *  1.  Every line is "machine state transition count".  Blank lines and lines
+ *      that start with a '#' are skipped.  Names that are no longer in the
+ *      definition are reported and skipped, so an old profile still works.
+ *
+ *  2.  The states of every machine that has counters are sorted so that the
+ *      ones that are used the most come first, which puts their rows next to
+ *      each other in the tables and their code next to each other in the
+ *      other backends.  START is always kept as the first state.
+ *
+ *  The emitter uses the counters to number the column classes and to order
+ *  and annotate the cases of the switch, goto and tail backends.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parse.h"
+#include "errors.h"
+
+static machine_t *find_machine(definition_t *def, char *name) {
+
+    machine_t *mac;
+
+    for(mac = def->machine_list; mac != NULL; mac = mac->next)
+        if(!strcmp(mac->name, name))
+            return mac;
+    return NULL;
+}
+
+static int find_name(string_list_t *list, char *name) {
+
+    int i;
+
+    for(i = 0; list != NULL; list = list->next, i++)
+        if(!strcmp(list->strg, name))
+            return i;
+    return -1;
+}
+
+static unsigned long long row_total(machine_t *mac, int state) {
+
+    unsigned long long total = 0;
+    int i;
+
+    for(i = 0; i < mac->num_trans; i++)
+        total += mac->counts[state * mac->num_trans + i];
+    return total;
+}
+
+/*
+ *  Sort the states after START by how many times they were used, keeping the
+ *  order of the definition for the ones that were used the same number of
+ *  times.  The rows of the counters are moved with them.
+ */
+static void sort_states(machine_t *mac) {
+
+    string_list_t **list, *lst;
+    unsigned long long *counts, *total;
+    int *order, i, j, k;
+
+    list = calloc(mac->num_states, sizeof(string_list_t *));
+    order = calloc(mac->num_states, sizeof(int));
+    total = calloc(mac->num_states, sizeof(unsigned long long));
+    counts = calloc(mac->num_states * mac->num_trans, sizeof(unsigned long long));
+    if(!list || !order || !total || !counts)
+        SERROR(FATAL_ERROR, "Cannot allocate the state order");
+
+    for(lst = mac->states, i = 0; lst != NULL; lst = lst->next, i++) {
+        list[i] = lst;
+        order[i] = i;
+        total[i] = row_total(mac, i);
+    }
+
+    // insertion sort, which is stable, and START stays where it is
+    for(i = 2; i < mac->num_states; i++) {
+        k = order[i];
+        for(j = i; j > 1 && total[order[j - 1]] < total[k]; j--)
+            order[j] = order[j - 1];
+        order[j] = k;
+    }
+
+    for(i = 0; i < mac->num_states; i++) {
+        list[order[i]]->next = (i < mac->num_states - 1)? list[order[i + 1]]: NULL;
+        memcpy(&counts[i * mac->num_trans], &mac->counts[order[i] * mac->num_trans],
+                mac->num_trans * sizeof(unsigned long long));
+    }
+    mac->states = list[order[0]];
+    free(mac->counts);
+    mac->counts = counts;
+
+    free(list);
+    free(order);
+    free(total);
+}
+
+int read_profile(definition_t *def, char *name) {
+
+    FILE *pf;
+    machine_t *mac;
+    char line[1024], mname[256], sname[256], tname[256];
+    unsigned long long count;
+    int state, trans, line_no = 0, skipped = 0;
+
+    if(NULL == (pf = fopen(name, "r"))) {
+        fprintf(stderr, "PROFILE ERROR: Cannot open the profile \"%s\": ", name);
+        perror("");
+        return 1;
+    }
+
+    while(NULL != fgets(line, sizeof(line), pf)) {
+        line_no++;
+        if(line[strspn(line, " \t\r\n")] == 0 || line[strspn(line, " \t")] == '#')
+            continue;
+        if(4 != sscanf(line, "%255s %255s %255s %llu", mname, sname, tname, &count)) {
+            fprintf(stderr, "PROFILE ERROR: %s: %d: Expected \"machine state transition count\"\n",
+                    name, line_no);
+            fclose(pf);
+            return 1;
+        }
+
+        if(NULL == (mac = find_machine(def, mname))
+                || 0 > (state = find_name(mac->states, sname))
+                || 0 > (trans = find_name(mac->trans, tname))) {
+            skipped++;
+            continue;
+        }
+
+        if(NULL == mac->counts
+                && NULL == (mac->counts = calloc(mac->num_states * mac->num_trans, sizeof(unsigned long long))))
+            SERROR(FATAL_ERROR, "Cannot allocate the profile counters");
+        mac->counts[state * mac->num_trans + trans] += count;
+    }
+    fclose(pf);
+
+    if(skipped)
+        fprintf(stderr, "PROFILE WARNING: %s: %d line%s named something that is not in the definition\n",
+                name, skipped, (skipped > 1)? "s": "");
+
+    for(mac = def->machine_list; mac != NULL; mac = mac->next) {
+        if(NULL == mac->counts)
+            continue;
+        sort_states(mac);
+        printf("%s: states ordered by the profile\n", mac->name);
+    }
+    return 0;
+}
@@ -0,0 +1,6 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+int read_profile(definition_t *def, char *name);
+
+#endif /* PROFILE_H */
@@ -435,7 +435,7 @@ int init_scanner(void) {
 
     int i;
 
-    for(i = 0; i < sizeof(char_table); i++)
+    for(i = 0; i < sizeof(char_table)/sizeof(char_table[0]); i++)
         char_table[i] = INVALID;
 
     for(i = 0; stop[i] != 0; i++)
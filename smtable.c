@@ -0,0 +1,376 @@
+/*
+ *  The purpose of this module is to run the machines in a binary table file
+ *  that "-b:binary" wrote, so the machines can be changed without building
+ *  the program again.
+ *
+ *  1.  The file is mapped read only, so every process that opens it shares
+ *      the same pages.  Where there is no mmap() it is read instead.
+ *
+ *  2.  Everything in the file is checked when it is opened, so a file that
+ *      is damaged or is from another version is refused instead of running
+ *      off the end of a table.
+ *
+ *  3.  The names in the file are bound to the functions that the caller
+ *      gives, and every name has to be bound.  After that the machines run
+ *      the same way as the table backend runs them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#  define SM_USE_MMAP
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#endif
+
+#include "smtable.h"
+
+// machines that call machines deeper than this fail instead of overflowing
+#define SM_TABLES_DEPTH 64
+
+typedef struct {
+    const sm_file_machine_t *file;
+    const uint8_t *chars;
+    const uint16_t *next;
+    const uint16_t *action;
+    sm_func_t input;
+    sm_func_t precode;
+    sm_func_t postcode;
+} sm_machine_rt_t;
+
+typedef struct {
+    sm_func_t func;
+    int machine;            // or -1 for a function
+} sm_action_rt_t;
+
+struct sm_tables_t {
+    const unsigned char *base;
+    size_t size;
+    int mapped;
+    const sm_file_header_t *header;
+    sm_machine_rt_t *machines;
+    sm_action_rt_t *actions;
+};
+
+static char error_text[256] = "";
+
+static void set_error(const char *fmt, ...) {
+
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(error_text, sizeof(error_text), fmt, args);
+    va_end(args);
+}
+
+/*
+ *  Return the reason that the last call to sm_tables_open() failed.
+ */
+const char *sm_tables_error(void) {
+    return error_text;
+}
+
+/*
+ *  Return non-zero if count things of the size at offset are in the file and
+ *  start on a boundary that they can be read from.
+ */
+static int in_file(const sm_tables_t *t, uint32_t offset, size_t count, size_t size, size_t align) {
+
+    return offset % align == 0 && offset <= t->size && count <= (t->size - offset) / size;
+}
+
+/*
+ *  Return the name at the offset in the strings, or NULL if it is not there.
+ */
+static const char *get_name(const sm_tables_t *t, uint32_t offset) {
+
+    const char *strings = (const char *)t->base + t->header->strings;
+
+    if(offset >= t->header->strings_size)
+        return NULL;
+    if(NULL == memchr(strings + offset, 0, t->header->strings_size - offset))
+        return NULL;
+    return strings + offset;
+}
+
+static int bind(const sm_tables_t *t, uint32_t offset, const sm_binding_t *bindings,
+                int num_bindings, sm_func_t *func) {
+
+    const char *name;
+    int i;
+
+    *func = NULL;
+    if(offset == SM_FILE_NONE)
+        return 0;
+    if(NULL == (name = get_name(t, offset))) {
+        set_error("a name is outside of the strings");
+        return -1;
+    }
+    for(i = 0; i < num_bindings; i++) {
+        if(!strcmp(bindings[i].name, name)) {
+            *func = bindings[i].func;
+            return 0;
+        }
+    }
+    set_error("no function is bound to \"%s\"", name);
+    return -1;
+}
+
+static int load_file(sm_tables_t *t, const char *name) {
+
+#ifdef SM_USE_MMAP
+    struct stat st;
+    void *addr;
+    int fd;
+
+    if(0 > (fd = open(name, O_RDONLY))) {
+        set_error("cannot open \"%s\": %s", name, strerror(errno));
+        return -1;
+    }
+    if(0 != fstat(fd, &st) || st.st_size < (off_t)sizeof(sm_file_header_t)) {
+        set_error("\"%s\" is too small to be a table file", name);
+        close(fd);
+        return -1;
+    }
+    addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(MAP_FAILED == addr) {
+        set_error("cannot map \"%s\": %s", name, strerror(errno));
+        return -1;
+    }
+    t->base = addr;
+    t->size = (size_t)st.st_size;
+    t->mapped = 1;
+#else
+    FILE *fp;
+    unsigned char *buf;
+    long size;
+
+    if(NULL == (fp = fopen(name, "rb"))) {
+        set_error("cannot open \"%s\": %s", name, strerror(errno));
+        return -1;
+    }
+    if(0 != fseek(fp, 0, SEEK_END) || (size = ftell(fp)) < (long)sizeof(sm_file_header_t)
+            || 0 != fseek(fp, 0, SEEK_SET) || NULL == (buf = malloc((size_t)size))) {
+        set_error("cannot read \"%s\"", name);
+        fclose(fp);
+        return -1;
+    }
+    if(fread(buf, 1, (size_t)size, fp) != (size_t)size) {
+        set_error("cannot read \"%s\"", name);
+        free(buf);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    t->base = buf;
+    t->size = (size_t)size;
+#endif
+    t->header = (const sm_file_header_t *)t->base;
+    return 0;
+}
+
+static int check_header(const sm_tables_t *t) {
+
+    const sm_file_header_t *h = t->header;
+
+    if(h->magic != SM_FILE_MAGIC) {
+        set_error("not a table file");
+        return -1;
+    }
+    if(h->byte_order != SM_FILE_BYTE_ORDER) {
+        set_error("the table file was written on a machine with the other byte order");
+        return -1;
+    }
+    if(h->version != SM_FILE_VERSION) {
+        set_error("the table file is version %d, this runtime reads version %d",
+                h->version, SM_FILE_VERSION);
+        return -1;
+    }
+    if(h->size != t->size
+            || !in_file(t, h->machines, h->num_machines, sizeof(sm_file_machine_t), 8)
+            || !in_file(t, h->actions, h->num_actions, sizeof(sm_file_action_t), 8)
+            || !in_file(t, h->strings, h->strings_size, 1, 1)
+            || h->num_actions == 0) {
+        set_error("the table file is damaged");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ *  Check the tables of a machine, so the runner does not have to.
+ */
+static int check_machine(const sm_tables_t *t, sm_machine_rt_t *m) {
+
+    const sm_file_machine_t *f = m->file;
+    size_t cells = (size_t)f->num_states * f->num_trans, i;
+
+    if(f->num_states == 0 || f->num_states > 0xFFFD || f->num_trans == 0 || f->num_trans > 0xFFFF
+            || !in_file(t, f->next, cells, sizeof(uint16_t), 8)
+            || !in_file(t, f->action, cells, sizeof(uint16_t), 8)
+            || (f->chars != SM_FILE_NONE && !in_file(t, f->chars, 256, 1, 8))) {
+        set_error("the tables of a machine are damaged");
+        return -1;
+    }
+    m->next = (const uint16_t *)(t->base + f->next);
+    m->action = (const uint16_t *)(t->base + f->action);
+    m->chars = (f->chars == SM_FILE_NONE)? NULL: t->base + f->chars;
+
+    for(i = 0; i < cells; i++)
+        if(m->next[i] > f->num_states + 1 || m->action[i] >= t->header->num_actions) {
+            set_error("a machine has a transition that is out of range");
+            return -1;
+        }
+    if(m->chars != NULL)
+        for(i = 0; i < 256; i++)
+            if(m->chars[i] >= f->num_trans) {
+                set_error("a machine has a byte that is out of range");
+                return -1;
+            }
+    return 0;
+}
+
+/*
+ *  Open a table file and bind the names in it to the functions.  Returns
+ *  NULL and sets the text of sm_tables_error() when it cannot.
+ */
+sm_tables_t *sm_tables_open(const char *name, const sm_binding_t *bindings, int num_bindings) {
+
+    sm_tables_t *t;
+    const sm_file_machine_t *fm;
+    const sm_file_action_t *fa;
+    uint32_t i;
+
+    if(NULL == (t = calloc(1, sizeof(sm_tables_t)))) {
+        set_error("cannot allocate the tables");
+        return NULL;
+    }
+    if(0 != load_file(t, name) || 0 != check_header(t))
+        goto fail;
+
+    t->machines = calloc(t->header->num_machines + 1, sizeof(sm_machine_rt_t));
+    t->actions = calloc(t->header->num_actions, sizeof(sm_action_rt_t));
+    if(NULL == t->machines || NULL == t->actions) {
+        set_error("cannot allocate the tables");
+        goto fail;
+    }
+
+    fm = (const sm_file_machine_t *)(t->base + t->header->machines);
+    for(i = 0; i < t->header->num_machines; i++) {
+        t->machines[i].file = &fm[i];
+        if(NULL == get_name(t, fm[i].name)) {
+            set_error("a name is outside of the strings");
+            goto fail;
+        }
+        if(0 != check_machine(t, &t->machines[i])
+                || 0 != bind(t, fm[i].input, bindings, num_bindings, &t->machines[i].input)
+                || 0 != bind(t, fm[i].precode, bindings, num_bindings, &t->machines[i].precode)
+                || 0 != bind(t, fm[i].postcode, bindings, num_bindings, &t->machines[i].postcode))
+            goto fail;
+        if(NULL == t->machines[i].input) {
+            set_error("the machine \"%s\" has no input function", get_name(t, fm[i].name));
+            goto fail;
+        }
+    }
+
+    fa = (const sm_file_action_t *)(t->base + t->header->actions);
+    t->actions[0].machine = -1;
+    for(i = 1; i < t->header->num_actions; i++) {
+        if(fa[i].machine != SM_FILE_NONE) {
+            if(fa[i].machine >= t->header->num_machines) {
+                set_error("an action runs a machine that is not in the file");
+                goto fail;
+            }
+            t->actions[i].machine = (int)fa[i].machine;
+        }
+        else {
+            t->actions[i].machine = -1;
+            if(0 != bind(t, fa[i].name, bindings, num_bindings, &t->actions[i].func))
+                goto fail;
+        }
+    }
+    return t;
+
+fail:
+    sm_tables_close(t);
+    return NULL;
+}
+
+void sm_tables_close(sm_tables_t *t) {
+
+    if(NULL == t)
+        return;
+#ifdef SM_USE_MMAP
+    if(t->mapped)
+        munmap((void *)t->base, t->size);
+#else
+    free((void *)t->base);
+#endif
+    free(t->machines);
+    free(t->actions);
+    free(t);
+}
+
+/*
+ *  Return the number of the machine with the name, or -1.
+ */
+int sm_tables_machine(const sm_tables_t *t, const char *name) {
+
+    uint32_t i;
+
+    for(i = 0; i < t->header->num_machines; i++)
+        if(!strcmp(get_name(t, t->machines[i].file->name), name))
+            return (int)i;
+    return -1;
+}
+
+static int run_machine(const sm_tables_t *t, int machine, void *ctx, int depth) {
+
+    const sm_machine_rt_t *m = &t->machines[machine];
+    const sm_action_rt_t *a;
+    int num_states = (int)m->file->num_states, num_trans = (int)m->file->num_trans;
+    int state = 0, trans, cell;
+
+    if(depth > SM_TABLES_DEPTH)
+        return -1;
+
+    if(m->precode)
+        (*m->precode)(ctx);
+    do{
+        trans = (*m->input)(ctx);
+        if(m->chars != NULL)
+            trans = (trans >= 0 && trans < 256)? m->chars[trans]: -1;
+        if(trans < 0 || trans >= num_trans)
+            return -1;
+        cell = state * num_trans + trans;
+        if(m->action[cell] != 0) {
+            a = &t->actions[m->action[cell]];
+            if(a->machine >= 0)
+                run_machine(t, a->machine, ctx, depth + 1);
+            else
+                (*a->func)(ctx);
+        }
+        state = m->next[cell];
+    }while(state < num_states);
+    if(m->postcode)
+        (*m->postcode)(ctx);
+    return (state == num_states)? 0: -1;
+}
+
+/*
+ *  Run the machine until it gets to END or ERROR.  Returns 0 for END and -1
+ *  for ERROR, the same as the generated machines do.  An input that is not a
+ *  transition of the machine is an ERROR.
+ */
+int sm_tables_run(const sm_tables_t *t, int machine, void *ctx) {
+
+    if(machine < 0 || (uint32_t)machine >= t->header->num_machines)
+        return -1;
+    return run_machine(t, machine, ctx, 0);
+}
@@ -0,0 +1,69 @@
+#ifndef SMTABLE_H
+#define SMTABLE_H
+
+#include <stdint.h>
+
+/*
+ *  The binary table file that "-b:binary" writes, and the runtime that runs
+ *  the machines in it without generating any C.  Every section of the file
+ *  starts on an 8 byte boundary and every offset is from the start of the
+ *  file, so the file can be used where it is mapped.
+ */
+#define SM_FILE_MAGIC       0x31544D53  // "SMT1"
+#define SM_FILE_VERSION     1
+#define SM_FILE_BYTE_ORDER  0x0102      // reads as 0x0201 on the other byte order
+#define SM_FILE_NONE        0xFFFFFFFF  // no name, no table or no machine
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t byte_order;
+    uint32_t size;          // of the whole file
+    uint32_t num_machines;
+    uint32_t num_actions;   // action 0 is every action that does nothing
+    uint32_t machines;      // sm_file_machine_t[num_machines]
+    uint32_t actions;       // sm_file_action_t[num_actions]
+    uint32_t strings;       // the names, every one ends with a 0
+    uint32_t strings_size;
+    uint32_t unused;
+} sm_file_header_t;
+
+typedef struct {
+    uint32_t name;          // offset of the name in the strings
+    uint32_t input;         // the name of the input function
+    uint32_t precode;       // the name of the function, or SM_FILE_NONE
+    uint32_t postcode;
+    uint32_t num_states;    // END and ERROR are numbered after these
+    uint32_t num_trans;
+    uint32_t chars;         // uint8_t[256] transition of every byte, or SM_FILE_NONE
+    uint32_t next;          // uint16_t[num_states][num_trans] next state
+    uint32_t action;        // uint16_t[num_states][num_trans] action number
+    uint32_t unused;
+} sm_file_machine_t;
+
+typedef struct {
+    uint32_t name;
+    uint32_t machine;       // the machine that the action runs, or SM_FILE_NONE
+} sm_file_action_t;
+
+/*
+ *  Every action, input, pre_code and post_code function that the file names
+ *  has to be bound to a function when the file is opened.
+ */
+typedef int (*sm_func_t)(void *ctx);
+
+typedef struct {
+    const char *name;
+    sm_func_t func;
+} sm_binding_t;
+
+typedef struct sm_tables_t sm_tables_t;
+
+sm_tables_t *sm_tables_open(const char *name, const sm_binding_t *bindings, int num_bindings);
+void sm_tables_close(sm_tables_t *tables);
+const char *sm_tables_error(void);
+
+int sm_tables_machine(const sm_tables_t *tables, const char *name);
+int sm_tables_run(const sm_tables_t *tables, int machine, void *ctx);
+
+#endif /* SMTABLE_H */
@@ -22,6 +22,7 @@ token_t tokens[] = {
     {",",           COMMA_SYMBOL,       STATIC_TOKEN},
     {";",           SEMI_SYMBOL,        STATIC_TOKEN},
     {":",           COLON_SYMBOL,       STATIC_TOKEN},
+    {"=",           EQUAL_SYMBOL,       STATIC_TOKEN},
 
     {"include",     INCLUDE_SYMBOL,     STATIC_TOKEN},
     {"machine",     MACHINE_SYMBOL,     STATIC_TOKEN},
@@ -32,6 +33,9 @@ token_t tokens[] = {
     {"state",       STATE_SYMBOL,       STATIC_TOKEN},
     {"pre_code",    PRECODE_SYMBOL,     STATIC_TOKEN},
     {"post_code",   POSTCODE_SYMBOL,    STATIC_TOKEN},
+    {"layout",      LAYOUT_SYMBOL,      STATIC_TOKEN},
+    {"no_op",       NOOP_SYMBOL,        STATIC_TOKEN},
+    {"classify",    CLASSIFY_SYMBOL,    STATIC_TOKEN},
     {NULL, -1 -1}
 };
 
@@ -40,17 +44,21 @@ static token_t *tok_stack[1024*1]; // a -lot- bigger than required
 static int tok_stack_idx = 0;
 
 static inline int qtest(int ch) {
-    return (ch == '\'' || ch == '\"' || ch == ' ' || ch == '\t');
+    return (ch == '\'' || ch == '\"');
 }
 
+/*
+ *  Only the quotes are removed, because the spaces inside of a quoted string
+ *  can matter, such as in a character set.
+ */
 static inline char *strip_quotes(char *strg) {
 
-    char *spt1, *spt2;
+    size_t len = strlen(strg);
 
-    for(spt1 = strg; qtest(*spt1); spt1++);
-    memmove(strg, spt1, strlen(spt1)+1);
-    for(spt2 = &spt1[strlen(spt1)]; qtest(*spt2); spt2--)
-        *spt2 = 0;
+    if(len > 0 && qtest(strg[len - 1]))
+        strg[--len] = 0;
+    if(len > 0 && qtest(strg[0]))
+        memmove(strg, &strg[1], len);
     return strg;
 }
 
@@ -112,7 +120,7 @@ token_t *get_token(void) {
         tok->stype = FILE_END_SYMBOL;
     }
     else if(strg[0] == '\'' || strg[0] == '\"') {
-        strip_quotes(strg);
+        strip_quotes(tok->strg);
         tok->type = QSTRG_SYMBOL;
         tok->stype = QSTRG_SYMBOL;
     }
@@ -169,6 +177,10 @@ int token_open_file(char *name) {
                         (TRANS_SYMBOL == t)? "TRANS_SYMBOL": \
                         (TRANS_SYMBOL == t)? "TRANS_SYMBOL": \
                         (STATE_SYMBOL == t)? "STATE_SYMBOL": \
+                        (LAYOUT_SYMBOL == t)? "LAYOUT_SYMBOL": \
+                        (NOOP_SYMBOL == t)? "NOOP_SYMBOL": \
+                        (CLASSIFY_SYMBOL == t)? "CLASSIFY_SYMBOL": \
+                        (EQUAL_SYMBOL == t)? "EQUAL_SYMBOL": \
                         (RAW_BLOCK == t)? "RAW_BLOCK": \
                         (INLINE_BLOCK == t)? "INLINE_BLOCK": \
                         (UNKNOWN_SYMBOL == t)? "UNKNOWN_SYMBOL": \
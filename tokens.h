@@ -36,6 +36,10 @@ enum {
     FILE_END_SYMBOL,
     RAW_BLOCK,
     INLINE_BLOCK,
+    LAYOUT_SYMBOL,
+    NOOP_SYMBOL,
+    CLASSIFY_SYMBOL,
+    EQUAL_SYMBOL,
 
 };
 
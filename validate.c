@@ -15,6 +15,10 @@
  *  3.  Verify that all of the state definitions are actually declaired in the
  *      states definition.  This is an error that is caught by the compiler.
  *
+ *  4.  Build the table that turns a byte into a transition for a machine
+ *      whose transitions have character sets, and verify that every byte is
+ *      in exactly one set.
+ *
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,9 +29,99 @@
 #include "errors.h"
 
 /*
- *  Stub this out.
+ *  Verify that the layout of the machine is one that the emitter knows about.
+ */
+static int validate_layout(machine_t *mac) {
+
+    if(NULL == mac->layout)
+        return 0;
+
+    if(strcmp(mac->layout, "dense") && strcmp(mac->layout, "comb")) {
+        fprintf(stderr, "VALIDATE ERROR: %s: Unknown layout \"%s\"\n", mac->name, mac->layout);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ *  Build the table that turns a byte into a transition for a machine that
+ *  has character sets.  Every byte must be in exactly one of the sets of the
+ *  machine, or else there must be a DEFAULT set to take the ones left over.
+ *  The value is the column of the transition, which is its place in the list.
  */
+static int validate_chars(definition_t *def, machine_t *mac) {
+
+    char_set_t *set, *dflt = NULL;
+    string_list_t *lst;
+    int col, c, errors = 0, found = 0;
+
+    if(NULL == (mac->chars = calloc(256, sizeof(unsigned char))))
+        SERROR(FATAL_ERROR, "Cannot allocate the character table");
+    for(c = 0; c < 256; c++)
+        mac->chars[c] = 0xFF;
+
+    for(lst = mac->trans, col = 0; lst != NULL; lst = lst->next, col++) {
+        for(set = def->char_sets; set != NULL; set = set->next)
+            if(!strcmp(set->name, lst->strg))
+                break;
+        if(NULL == set)
+            continue;
+        found++;
+        if(set->is_default) {
+            if(NULL != dflt) {
+                fprintf(stderr, "VALIDATE ERROR: %s: \"%s\" and \"%s\" are both DEFAULT\n",
+                        mac->name, dflt->name, set->name);
+                errors++;
+            }
+            dflt = set;
+        }
+        for(c = 0; c < 256; c++) {
+            if(!set->bytes[c])
+                continue;
+            if(mac->chars[c] != 0xFF) {
+                fprintf(stderr, "VALIDATE ERROR: %s: 0x%02X is in the set of \"%s\" more than once\n",
+                        mac->name, c, set->name);
+                errors++;
+            }
+            mac->chars[c] = col;
+        }
+    }
+
+    if(found == 0) {
+        free(mac->chars);
+        mac->chars = NULL;
+        return 0;
+    }
+    if(mac->num_trans > 255) {
+        fprintf(stderr, "VALIDATE ERROR: %s: Too many transitions for a character table\n", mac->name);
+        return errors + 1;
+    }
+
+    for(c = 0; c < 256; c++) {
+        if(mac->chars[c] != 0xFF)
+            continue;
+        if(NULL == dflt) {
+            fprintf(stderr, "VALIDATE ERROR: %s: 0x%02X is not in any set and there is no DEFAULT\n",
+                    mac->name, c);
+            errors++;
+            break;
+        }
+        for(lst = mac->trans, col = 0; strcmp(lst->strg, dflt->name); lst = lst->next, col++)
+            ;
+        mac->chars[c] = col;
+    }
+    return errors;
+}
+
 int validate(definition_t *def) {
 
-    return 0;   // no errors
+    machine_t *mac;
+    int errors = 0;
+
+    for(mac = def->machine_list; mac != NULL; mac = mac->next) {
+        errors += validate_layout(mac);
+        errors += validate_chars(def, mac);
+    }
+
+    return errors;
 }